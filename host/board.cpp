@@ -0,0 +1,364 @@
+/*
+  The virtual board of board.h and the Arduino, ESP8266, LittleFS, ArduinoOTA and PubSubClient
+  stand-ins declared in stubs/.
+*/
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <new>
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ArduinoOTA.h>
+#include <LittleFS.h>
+#include <PubSubClient.h>
+#include "board.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+ArduinoOTAClass ArduinoOTA;
+LittleFSClass LittleFS;
+
+// ==================================== clock ==================================== //
+uint64_t hostTicks = 0;
+bool hostWallSet = false;
+int64_t hostWallStart = 0;
+double hostWallPpm = 0;
+
+void (*hostIsr)() = NULL;
+uint64_t hostIsrDue = 0;
+bool hostIsrArmed = false;
+unsigned long hostIsrRuns = 0;
+
+void hostAdvance(uint64_t ticks){
+  uint64_t until = hostTicks + ticks;
+  while (hostIsrArmed && (hostIsrDue <= until)){
+    hostTicks = hostIsrDue;
+    hostIsrArmed = false;                         // one shot, the ISR sets the next interval
+    hostIsrRuns++;
+    hostIsr();
+  }
+  hostTicks = until;
+}
+
+uint32_t hostMillisStart = 0;
+
+unsigned long millis(){                           // 32 bits like on the board
+  return (uint32_t)(hostMillisStart + hostTicks / (hostTimerHz / 1000));
+}
+
+unsigned long micros(){
+  return hostTicks / hostTicksPerUs;
+}
+
+void delay(unsigned long ms){
+  hostAdvanceUs((uint64_t)ms * 1000);
+}
+
+uint32_t randomState = 1;
+
+long random(long howbig){                         // the same sequence on every host
+  if (howbig <= 0) return 0;
+  randomState = randomState * 1103515245 + 12345;
+  return (randomState >> 1) % howbig;
+}
+
+long random(long howsmall, long howbig){
+  return (howsmall >= howbig) ? howsmall : howsmall + random(howbig - howsmall);
+}
+
+void randomSeed(unsigned long seed){
+  randomState = seed ? seed : 1;
+}
+
+// ====================== refresh interrupt and shift registers ===================== //
+hostFrameFn hostOnFrame = NULL;
+unsigned long hostFramesLatched = 0;
+bool hostLed = false;
+
+void hostStartTimer(void (*isr)(), uint32_t ticks){
+  hostIsr = isr;
+  hostNextTimer(ticks);
+}
+
+void hostNextTimer(uint32_t ticks){
+  hostIsrDue = hostTicks + ticks;
+  hostIsrArmed = true;
+}
+
+void hostShift(const uint8_t* frame, int len){
+  hostFramesLatched++;
+  if (hostOnFrame) hostOnFrame(hostTicks, frame, len);
+}
+
+// ==================================== broker =================================== //
+std::deque<hostMessage> hostInbox;
+bool hostFilter = false;
+hostPublishFn hostOnPublish = NULL;
+std::vector<std::string> hostSubscriptions;
+bool hostWifiUp = true;
+bool hostBrokerUp = true;
+uint32_t hostConnectUs = 500000;
+uint32_t hostPollUs = 0;
+unsigned long hostConnects = 0;
+unsigned long hostDelivered = 0;
+unsigned long hostFiltered = 0;
+unsigned long hostTooLong = 0;
+unsigned long hostPublished = 0;
+unsigned long hostRefused = 0;
+
+void hostSend(uint64_t ticks, const std::string &topic, const std::string &payload){
+  hostMessage m = {ticks, topic, payload};
+  hostInbox.push_back(m);
+}
+
+bool hostTopicMatch(const char* filter, const char* topic){
+  while (*filter){
+    if (*filter == '#') return true;
+    if (*filter == '+'){
+      while (*topic && (*topic != '/')) topic++;
+      filter++;
+    } else if (*filter++ != *topic++) return false;
+  }
+  return *topic == 0;
+}
+
+bool hostSubscribed(const char* topic){
+  for (size_t i=0; i<hostSubscriptions.size(); i++){
+    if (hostTopicMatch(hostSubscriptions[i].c_str(), topic)) return true;
+  }
+  return false;
+}
+
+bool PubSubClient::setBufferSize(uint16_t size){
+  if (size == 0) return false;
+  uint8_t* grown = (uint8_t*)realloc(buffer, size);
+  if (grown == NULL) return false;
+  buffer = grown;
+  bufferSize = size;
+  return true;
+}
+
+bool PubSubClient::connect(const char*, const char*, const char*){
+  hostConnects++;
+  if (!hostWifiUp || !hostBrokerUp){
+    hostAdvanceUs(hostConnectUs);                 // waits for the TCP connect to time out
+    return false;
+  }
+  if ((buffer == NULL) && !setBufferSize(bufferSize)) return false;
+  hostSubscriptions.clear();                      // a clean session
+  linked = true;
+  return true;
+}
+
+bool PubSubClient::connected(){
+  if (!hostWifiUp || !hostBrokerUp) linked = false;
+  return linked;
+}
+
+// one packet per call, like the library
+bool PubSubClient::loop(){
+  if (!connected()) return false;
+  hostAdvanceUs(hostPollUs);
+  while (!hostInbox.empty() && (hostInbox.front().ticks <= hostTicks)){
+    const hostMessage &m = hostInbox.front();     // not copied, the allocation counts are the sketch's
+    if (hostFilter && !hostSubscribed(m.topic.c_str())){
+      hostFiltered++;
+      hostInbox.pop_front();
+      continue;
+    }
+    size_t topicLen = m.topic.size();
+    size_t length = m.payload.size();
+    bool fits = MQTT_MAX_HEADER_SIZE + 2 + topicLen + length <= bufferSize;
+    if (fits){
+      memcpy(buffer, m.topic.c_str(), topicLen + 1);
+      memcpy(buffer + topicLen + 1, m.payload.data(), length);
+    }
+    hostInbox.pop_front();
+    if (!fits){
+      hostTooLong++;
+      return true;
+    }
+    hostDelivered++;
+    if (callback) callback((char*)buffer, buffer + topicLen + 1, length);
+    return true;
+  }
+  return true;
+}
+
+bool PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length){
+  if (!connected()) return false;
+  if (MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + length > bufferSize){
+    hostRefused++;
+    return false;
+  }
+  // the packet goes together in buffer like writeString() and the payload loop of the library
+  // do it, forward byte by byte, over the topic and payload of a received message
+  size_t at = MQTT_MAX_HEADER_SIZE + 2;
+  while (*topic) buffer[at++] = *topic++;
+  size_t topicLen = at - MQTT_MAX_HEADER_SIZE - 2;
+  buffer[MQTT_MAX_HEADER_SIZE] = topicLen >> 8;
+  buffer[MQTT_MAX_HEADER_SIZE + 1] = topicLen;
+  for (unsigned int i=0; i<length; i++) buffer[at++] = payload[i];
+  hostPublished++;
+  if (hostOnPublish){                             // what went to the broker, the topic terminated
+    static char sent[1024];
+    size_t n = min(topicLen, sizeof(sent) - 1);
+    memcpy(sent, buffer + MQTT_MAX_HEADER_SIZE + 2, n);
+    sent[n] = 0;
+    hostOnPublish(sent, buffer + MQTT_MAX_HEADER_SIZE + 2 + topicLen, length);
+  }
+  return true;
+}
+
+bool PubSubClient::subscribe(const char* topic){
+  if (!connected() || (MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + 1 > bufferSize)) return false;
+  hostSubscriptions.push_back(topic);
+  return true;
+}
+
+int WiFiClass::status(){
+  return hostWifiUp ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+// ===================================== OTA ===================================== //
+uint32_t hostOtaBytes = 0;
+uint32_t hostOtaRate = 0;
+uint32_t hostOtaSectorUs = 0;
+
+void hostOtaSend(uint32_t bytes, uint32_t bytesPerMs, uint32_t sectorUs){
+  hostOtaBytes = bytes;
+  hostOtaRate = bytesPerMs ? bytesPerMs : 1;
+  hostOtaSectorUs = sectorUs;
+}
+
+void ArduinoOTAClass::handle(){                   // the whole transfer in one call, like _runUpdate()
+  if (hostOtaBytes == 0) return;
+  uint32_t size = hostOtaBytes;
+  hostOtaBytes = 0;
+  if (startFn) startFn();
+  uint32_t received = 0, buffered = 0;
+  while (received < size){
+    uint32_t chunk = min(1460U, size - received);
+    hostAdvanceUs((uint64_t)chunk * 1000 / hostOtaRate);
+    received += chunk;
+    buffered += chunk;
+    if ((buffered >= 4096) || (received == size)){  // the Updater writes a sector
+      buffered = (buffered >= 4096) ? buffered - 4096 : 0;
+      hostAdvanceUs(hostOtaSectorUs);
+    }
+    if (progressFn) progressFn(received, size);
+  }
+  if (endFn) endFn();
+}
+
+// ============================ RTC, file system, misc ============================ //
+uint32_t hostRtc[128];
+std::string hostFsDir;
+unsigned long hostFsWrites = 0;
+uint32_t hostMountUs = 0;
+const char* hostResetReason = "Power On";
+uint32_t hostFreeHeap = 40000;
+bool hostSerialEcho = false;
+unsigned long hostAllocs = 0;
+
+void* operator new(size_t size){
+  hostAllocs++;
+  void* p = malloc(size ? size : 1);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+
+void* operator new[](size_t size){
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  free(p);
+}
+
+size_t HardwareSerial::print(const char* text){
+  if (hostSerialEcho) fputs(text, stderr);
+  return strlen(text);
+}
+
+size_t HardwareSerial::printf(const char* format, ...){
+  va_list args;
+  va_start(args, format);
+  int n = hostSerialEcho ? vfprintf(stderr, format, args) : vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  return n;
+}
+
+size_t HardwareSerial::write(const uint8_t*, size_t length){   // binary trace records, not echoed
+  return length;
+}
+
+int HardwareSerial::availableForWrite(){
+  return 128;
+}
+
+uint32_t EspClass::getCycleCount(){
+  return (uint32_t)(hostTicks * (80000000 / hostTimerHz));
+}
+
+uint32_t EspClass::getFreeHeap(){
+  return hostFreeHeap;
+}
+
+uint32_t EspClass::getMaxFreeBlockSize(){
+  return hostFreeHeap * 3 / 4;
+}
+
+String EspClass::getResetReason(){
+  return hostResetReason;
+}
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size){
+  if (offset * 4 + size > sizeof(hostRtc)) return false;
+  memcpy(data, (uint8_t*)hostRtc + offset * 4, size);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size){
+  if (offset * 4 + size > sizeof(hostRtc)) return false;
+  memcpy((uint8_t*)hostRtc + offset * 4, data, size);
+  return true;
+}
+
+size_t File::write(const uint8_t* data, size_t length){
+  hostFsWrites++;
+  return fwrite(data, 1, length, f);
+}
+
+size_t File::size(){
+  struct stat st;
+  fflush(f);
+  return (fstat(fileno(f), &st) == 0) ? st.st_size : 0;
+}
+
+bool LittleFSClass::begin(){
+  struct stat st;
+  hostAdvanceUs(hostMountUs);
+  return !hostFsDir.empty() && (stat(hostFsDir.c_str(), &st) == 0) && S_ISDIR(st.st_mode);
+}
+
+File LittleFSClass::open(const char* path, const char* mode){
+  if (hostFsDir.empty()) return File();
+  return File(fopen((hostFsDir + path).c_str(), (strcmp(mode, "r") == 0) ? "rb" : "wb"));
+}
+
+bool LittleFSClass::rename(const char* from, const char* to){
+  return ::rename((hostFsDir + from).c_str(), (hostFsDir + to).c_str()) == 0;
+}
@@ -0,0 +1,87 @@
+/*
+  Virtual board of the host build: the clock, the refresh timer, the shift registers, RTC memory,
+  the file system, the access point and the MQTT broker the sketch sees when it runs on Linux.
+  hal_host.h and the stubs in stubs/ are built on it, the programs in host/ drive it.
+
+  The clock is virtual. It stands still while the sketch runs and only moves on in hostAdvance(),
+  called by delay(), by the stand-ins for calls that wait on the board (a broker poll, a connect
+  attempt, an OTA transfer) and by the harness between loop() passes. So a run gives the same
+  frames every time, however fast the host is. The refresh interrupt runs whenever the clock
+  passes its due time: on the board between two instructions, here at the next move of the clock.
+*/
+#ifndef BOARD_H
+#define BOARD_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+// ==================================== clock ==================================== //
+const uint32_t hostTimerHz = 5000000;       // timer1 ticks per second, halTimerHz of the board
+const uint32_t hostTicksPerUs = hostTimerHz / 1000000;
+extern uint64_t hostTicks;                  // virtual time since reset
+void hostAdvance(uint64_t ticks);           // move the clock on, running the refresh interrupt when due
+inline void hostAdvanceUs(uint64_t us){ hostAdvance(us * hostTicksPerUs); }
+inline uint64_t hostUs(){ return hostTicks / hostTicksPerUs; }
+extern uint32_t hostMillisStart;            // millis() at virtual time 0, set near 2^32 to run over the wrap
+
+// The clock SNTP keeps: not set until hostWallSet, then the time of day is hostWallStart plus
+// the virtual time, running hostWallPpm fast.
+extern bool hostWallSet;
+extern int64_t hostWallStart;               // ms since midnight UTC at virtual time 0
+extern double hostWallPpm;
+
+// ====================== refresh interrupt and shift registers ===================== //
+void hostStartTimer(void (*isr)(), uint32_t ticks);
+void hostNextTimer(uint32_t ticks);         // one shot, counted from now
+void hostShift(const uint8_t* frame, int len);   // a frame clocked into the chain and latched
+typedef void (*hostFrameFn)(uint64_t ticks, const uint8_t* frame, int len);
+extern hostFrameFn hostOnFrame;             // told about every latched frame, frame[0] is the first register
+extern unsigned long hostFramesLatched;
+extern unsigned long hostIsrRuns;
+extern bool hostLed;                        // the built-in LED is lit
+
+// ==================================== broker =================================== //
+// Messages from the other clients wait in hostInbox until their time has come, then client.loop()
+// takes them one per call. With hostFilter the broker only sends what the sketch subscribed to.
+struct hostMessage {
+  uint64_t ticks;                           // virtual time the broker has it
+  std::string topic;
+  std::string payload;
+};
+extern std::deque<hostMessage> hostInbox;
+void hostSend(uint64_t ticks, const std::string &topic, const std::string &payload);
+extern bool hostFilter;
+bool hostTopicMatch(const char* filter, const char* topic);    // MQTT wildcards + and #
+typedef void (*hostPublishFn)(const char* topic, const uint8_t* payload, unsigned int length);
+extern hostPublishFn hostOnPublish;         // told about every message the sketch publishes
+extern std::vector<std::string> hostSubscriptions;  // of the current connection
+extern bool hostWifiUp;
+extern bool hostBrokerUp;
+extern uint32_t hostConnectUs;              // a connect attempt to a broker that is down blocks this long
+extern uint32_t hostPollUs;                 // a client.loop() takes this long
+extern unsigned long hostConnects;          // connect attempts
+extern unsigned long hostDelivered;         // messages handed to the callback
+extern unsigned long hostFiltered;          // not subscribed, the broker did not send them
+extern unsigned long hostTooLong;           // dropped, larger than the client buffer
+extern unsigned long hostPublished;
+extern unsigned long hostRefused;           // publishes larger than the client buffer
+
+// ===================================== OTA ===================================== //
+// The next ArduinoOTA.handle() receives an image of bytes, arriving at bytesPerMs in chunks of
+// 1460 bytes, with a sectorUs stall for every 4 KB sector the Updater writes.
+void hostOtaSend(uint32_t bytes, uint32_t bytesPerMs, uint32_t sectorUs);
+extern uint32_t hostOtaBytes;               // of the image not yet taken, 0 once handle() received it
+
+// ============================ RTC, file system, misc ============================ //
+extern uint32_t hostRtc[128];               // RTC user memory, survives a reset when the harness keeps it
+extern std::string hostFsDir;               // directory of the LittleFS files, empty for no file system
+extern unsigned long hostFsWrites;
+extern uint32_t hostMountUs;                // LittleFS.begin() takes this long
+extern const char* hostResetReason;
+extern uint32_t hostFreeHeap;
+extern bool hostSerialEcho;                 // Serial output to stderr
+extern unsigned long hostAllocs;            // operator new calls since start
+
+#endif
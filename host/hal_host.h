@@ -0,0 +1,92 @@
+/*
+  hal.h of the host build: the same calls on the virtual board of board.h.
+
+  The shift registers record every latched frame, a frame sent from the refresh interrupt shows
+  right away. The timing figures are the ones of the SPI output of the board, so the sub frames
+  last as long as they do there. MQTT goes through the PubSubClient stand-in, like on the board.
+*/
+#ifndef HAL_HOST_H
+#define HAL_HOST_H
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include "board.h"
+
+extern PubSubClient client;         // defined in main.cpp
+
+const uint32_t halTimerHz = hostTimerHz;
+const uint32_t spiClock = 4000000;  // as on the board, sets the LSB time for long chains
+constexpr uint32_t halShiftTicks(uint32_t bits) {
+  return (bits * (uint64_t)halTimerHz + spiClock - 1) / spiClock;
+}
+const int halLatchDelay = 0;
+
+// ==================================== Clock ==================================== //
+inline unsigned long halMillis() {
+  return millis();
+}
+
+inline uint32_t halMicros() {
+  return micros();
+}
+
+inline boolean halWallClockMs(uint32_t &ms) {
+  if (!hostWallSet) return false;
+  int64_t wall = hostWallStart + (int64_t)(hostTicks / (hostTimerHz / 1000) * (1 + hostWallPpm / 1e6));
+  ms = ((wall % 86400000) + 86400000) % 86400000;
+  return true;
+}
+
+inline uint32_t halCycles() {
+  return ESP.getCycleCount();
+}
+
+// ================================ GPIO / output ================================ //
+inline void halInitPins() {
+}
+
+inline void halShiftOut(const uint8_t* frame, int len) {
+  hostShift(frame, len);
+}
+
+inline void halShiftOutIsr(const uint8_t* frame, int len) {
+  hostShift(frame, len);
+}
+
+inline void halLatchIsr() {
+}
+
+inline void halStartRefreshTimer(void (*isr)(), uint32_t ticks) {
+  hostStartTimer(isr, ticks);
+}
+
+inline void halNextRefresh(uint32_t ticks) {
+  hostNextTimer(ticks);
+}
+
+inline void halBuiltinLed(boolean on) {
+  hostLed = on;
+}
+
+// ===================================== MQTT ==================================== //
+inline boolean halPublish(const char* topic, const char* payload) {
+  return client.publish(topic, payload);
+}
+
+inline boolean halPublishBinary(const char* topic, const uint8_t* payload, unsigned int length) {
+  return client.publish(topic, payload, length);
+}
+
+inline boolean halSubscribe(const char* topic) {
+  return client.subscribe(topic);
+}
+
+inline boolean halMqttConnected() {
+  return client.connected();
+}
+
+inline boolean halMqttPoll() {
+  return client.loop();
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*
+  What the programs in host/ share to drive the sketch: include it after ../src/main.cpp.
+
+  A pass is one loop() and the time it takes on the board, the clock moves on by that much
+  afterwards. Every check runs in a child process of its own (forkRun()), so it starts from the
+  state of a fresh reset: the globals of the sketch, the virtual board and the broker.
+*/
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+const uint32_t passUs = 200;                // a loop() pass without messages on the board
+
+static char harnessNames[numSignalHeads][12];
+
+void nameAllHeads(){                        // before setup(): every output gets a head, the compiled-in ones keep theirs
+  for (int s=0; s<numSignalHeads; s++){
+    if (headNames[s] != NULL) continue;
+    snprintf(harnessNames[s], sizeof(harnessNames[s]), "H%d", s);
+    headNames[s] = harnessNames[s];
+  }
+}
+
+std::string topicOf(const char* format, ...){  // a topic under topicPrefix
+  char topic[maxTopicLength];
+  va_list args;
+  va_start(args, format);
+  int used = snprintf(topic, sizeof(topic), "%s", topicPrefix);
+  vsnprintf(topic + used, sizeof(topic) - used, format, args);
+  va_end(args);
+  return topic;
+}
+
+void sendNow(const std::string &topic, const std::string &payload){
+  hostSend(hostTicks, topic, payload);
+}
+
+void pass(uint32_t us = passUs){
+  loop();
+  hostAdvanceUs(us);
+}
+
+void runMs(uint64_t ms, uint32_t us = passUs){
+  uint64_t end = hostTicks + ms * (hostTimerHz / 1000);
+  while (hostTicks < end) pass(us);
+}
+
+double virtualMs(){
+  return (double)hostTicks / (hostTimerHz / 1000);
+}
+
+// ==================================== checks =================================== //
+int harnessFailures = 0;
+
+bool expect(bool ok, const char* format, ...){  // one line per check, FAIL counts
+  va_list args;
+  va_start(args, format);
+  printf("  %s ", ok ? "ok  " : "FAIL");
+  vprintf(format, args);
+  printf("\n");
+  va_end(args);
+  if (!ok) harnessFailures++;
+  return ok;
+}
+
+void note(const char* format, ...){         // a figure that is reported, not checked
+  va_list args;
+  va_start(args, format);
+  printf("       ");
+  vprintf(format, args);
+  printf("\n");
+  va_end(args);
+}
+
+// Run fn in a child process, as a fresh boot of the sketch, and return its failures.
+int forkRun(void (*fn)()){
+  fflush(stdout);
+  fflush(stderr);
+  pid_t child = fork();
+  if (child == 0){
+    alarm(120);                             // a sketch stuck in a loop fails the check instead of the run
+    harnessFailures = 0;
+    fn();
+    fflush(stdout);
+    _exit(harnessFailures > 250 ? 250 : harnessFailures);
+  }
+  int status = 0;
+  if ((child < 0) || (waitpid(child, &status, 0) != child)) return 1;
+  if (WIFSIGNALED(status)){
+    printf("  FAIL killed by signal %d\n", WTERMSIG(status));
+    return 1;
+  }
+  return WEXITSTATUS(status);
+}
+
+// ============================ files between the boots ============================ //
+bool saveFile(const std::string &path, const void* data, size_t length){
+  FILE* f = fopen(path.c_str(), "wb");
+  if (f == NULL) return false;
+  bool ok = fwrite(data, 1, length, f) == length;
+  return (fclose(f) == 0) && ok;
+}
+
+bool loadFile(const std::string &path, std::vector<uint8_t> &data){
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == NULL) return false;
+  data.clear();
+  uint8_t chunk[4096];
+  size_t got;
+  while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) data.insert(data.end(), chunk, chunk + got);
+  fclose(f);
+  return true;
+}
+
+#endif
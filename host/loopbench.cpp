@@ -0,0 +1,104 @@
+/*
+  Loop throughput of the sketch on the host: runs the real setup(), loop() and callback() against
+  the virtual board with a steady stream of JMRI messages and reports the loop passes per second
+  (what <host>/stats publishes) and the messages handled per second (<host>/stats/msgs).
+
+  By default the virtual clock follows the time the passes take on this host, plus the time the
+  sketch gives away in delay() and the broker poll, so the figures are those of a board as fast
+  as this host. With --step every pass takes that many us instead, the run is the same every time.
+
+  Use:  loopbench [--seconds 10] [--rate 200] [--step 0] [--poll 0]
+          --rate  messages per second from JMRI, 0 for as many as the sketch takes
+          --poll  us a broker poll takes
+*/
+#include <chrono>
+#include "../src/main.cpp"
+#include "harness.h"
+
+// the next message of the stream: set, light ON, flashing, query, in turn over the heads
+void sendMessage(unsigned long i, uint64_t ticks){
+  static const char* aspects[] = {"GREEN", "YELLOW", "RED", "FLASHINGRED"};
+  static const char* colours[] = {"green", "yellow", "red"};
+  const char* head = Heads.name[i % numSignalHeads];
+  char topic[maxTopicLength];
+  std::string payload;
+  switch ((i / numSignalHeads) % 4){
+    case 0:
+      snprintf(topic, sizeof(topic), "%s%s/set", topicPrefix, head);
+      payload = aspects[(i / numSignalHeads / 4) % 4];
+      break;
+    case 1:
+      snprintf(topic, sizeof(topic), "%slight/set/%s-%s", topicPrefix, head, colours[(i / numSignalHeads / 4) % 3]);
+      payload = "ON";
+      break;
+    case 2:
+      snprintf(topic, sizeof(topic), "%slight/set/%s-flashing", topicPrefix, head);
+      payload = "OFF";
+      break;
+    default:
+      snprintf(topic, sizeof(topic), "%s%s", topicPrefix, head);
+      payload = "?";
+  }
+  hostSend(ticks, topic, payload);
+}
+
+int main(int argc, char** argv){
+  double seconds = 10;
+  double rate = 200;
+  long step = 0;
+  for (int i=1; i+1<argc; i+=2){
+    if (strcmp(argv[i], "--seconds") == 0) seconds = atof(argv[i+1]);
+    else if (strcmp(argv[i], "--rate") == 0) rate = atof(argv[i+1]);
+    else if (strcmp(argv[i], "--step") == 0) step = atol(argv[i+1]);
+    else if (strcmp(argv[i], "--poll") == 0) hostPollUs = atol(argv[i+1]);
+    else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 2;
+    }
+  }
+  hostFilter = true;
+  nameAllHeads();
+  setup();
+
+  const uint64_t end = hostTicks + (uint64_t)(seconds * hostTimerHz);
+  const uint64_t start = hostTicks;
+  const uint64_t interval = (rate > 0) ? (uint64_t)(hostTimerHz / rate) : 0;
+  uint64_t nextMessage = start;
+  unsigned long sent = 0;
+  unsigned long passes = 0;
+  uint64_t given = 0;                           // ticks the sketch gave away in delay() and polls
+  auto wallStart = std::chrono::steady_clock::now();
+  while (hostTicks < end){
+    if (interval){
+      while (nextMessage <= hostTicks){
+        sendMessage(sent++, nextMessage);
+        nextMessage += interval;
+      }
+    } else if (hostInbox.empty()) sendMessage(sent++, hostTicks);
+    uint64_t before = hostTicks;
+    loop();
+    passes++;
+    given += hostTicks - before;
+    if (step) hostAdvanceUs(step);
+    else {
+      uint64_t wall = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - wallStart).count();
+      uint64_t target = start + wall * hostTicksPerUs / 1000 + given;
+      if (target > hostTicks) hostAdvance(target - hostTicks);
+    }
+  }
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  double virtualSeconds = (double)(hostTicks - start) / hostTimerHz;
+
+  printf("loopbench: %d register(s), %d heads, %.1f s on the virtual clock %s\n", numShiftRegisters,
+         numSignalHeads, virtualSeconds, step ? "stepped" : "following this host");
+  printf("  loops/s   %10.0f   loop() passes, what <host>/stats publishes\n", passes / virtualSeconds);
+  printf("  msgs/s    %10.1f   handled, what <host>/stats/msgs publishes, %.0f/s offered\n",
+         hostDelivered / virtualSeconds, sent / virtualSeconds);
+  printf("  heads     %10lu   runs of the heads task, %lu missed their deadline\n",
+         (unsigned long)taskCounts[TASK_HEADS].runs, (unsigned long)taskCounts[TASK_HEADS].misses);
+  printf("  published %10lu   messages, %lu refused as too long, %lu received dropped as too long\n",
+         hostPublished, hostRefused, hostTooLong);
+  printf("  wall      %10.2f   s, %.0f passes and %.0f messages per wall second\n", wallSeconds,
+         passes / wallSeconds, hostDelivered / wallSeconds);
+  return 0;
+}
@@ -0,0 +1,294 @@
+/*
+  Microbenchmarks of the hot paths of the sketch, built from the same sources as the firmware:
+  callback() per message form, a heads pass (updateHeads() and renderFrames()) with all heads
+  steady, fading, flashing or yellow, the state topics of a head and utcTime(). Each reports the
+  ns per call, the best of several runs on this host, and the heap allocations per call.
+
+  A run saved with --save is the baseline of a later --compare: a benchmark more than the
+  threshold percent slower, or with more allocations per call than the baseline, fails the run.
+  The figures are those of this host, compare runs on the same one. On the board the bench
+  server command times the same paths.
+
+  Use:  microbench [--save FILE] [--compare FILE] [--threshold 10] [--runs 15] [name ...]
+*/
+#include <chrono>
+#include "../src/main.cpp"
+#include "harness.h"
+
+struct benchResult {
+  std::string name;
+  double ns;                                // per call, the best run
+  double allocs;                            // per call
+};
+
+int benchRuns = 15;
+const double benchRunNs = 2e6;              // a run takes about this long
+
+// ================================ message forms ================================= //
+struct messageBench {
+  const char* name;
+  std::string topic;
+  std::string payload;
+};
+std::vector<messageBench> messageBenches;
+char benchTopic[maxTopicLength];
+
+void addMessages(){
+  const char* head = Heads.name[0];
+  std::string batch;
+  for (int s=0; s<min(4, numSignalHeads); s++) batch += std::string(s ? ";" : "") + Heads.name[s] + "=GREEN";
+  messageBench forms[] = {
+    {"callback set", topicOf("%s/set", head), "GREEN"},
+    {"callback set flashing", topicOf("%s/set", head), "FLASHINGYELLOW"},
+    {"callback light dash", topicOf("light/set/%s-green", head), "ON"},
+    {"callback light level", topicOf("light/set/%s/red", head), "ON"},
+    {"callback flashing", topicOf("light/set/%s-flashing", head), "OFF"},
+    {"callback query", topicOf("%s", head), "?"},
+    {"callback light query", topicOf("light/%s/green", head), "?"},
+    {"callback other head", topicOf("elsewhere/set"), "RED"},
+    {"callback not signal", "JMRI/turnout/IT12", "THROWN"},
+    {"callback unknown word", topicOf("%s/set", head), "PURPLE"},
+    {"callback batch", topicOf("%s/batch", myHostname), batch},
+  };
+  messageBenches.assign(forms, forms + sizeof(forms) / sizeof(forms[0]));
+}
+
+// ================================== head states ================================== //
+// The heads are put into the state by the sketch itself, kept, and put back before every run,
+// so each run times the same passes.
+struct headsBench {
+  const char* name;
+  const char* payload;                      // sent to every head
+  uint32_t settleMs;                        // loop() passes after it, before the state is kept
+};
+const headsBench headsBenches[] = {
+  {"heads steady", "RED", 3000},
+  {"heads fading", "GREEN", 20},
+  {"heads flashing", "FLASHINGRED", 3000},
+  {"heads yellow", "YELLOW", 3000},
+};
+const uint32_t headsPassMs = 4;             // the heads task period
+
+struct headsState {
+  headTable heads;
+  uint32_t wasFading[numHeadWords];
+  long nextDimStep;
+  long now;
+  boolean flashOn;
+  boolean headsIdle;
+};
+headsState kept;
+
+void keepHeads(headsState &k){
+  memcpy(&k.heads, &Heads, sizeof(Heads));
+  memcpy(k.wasFading, wasFading, sizeof(wasFading));
+  k.nextDimStep = nextDimStep;
+  k.now = now;
+  k.flashOn = flashOn;
+  k.headsIdle = headsIdle;
+}
+
+void restoreHeads(const headsState &k){
+  memcpy(&Heads, &k.heads, sizeof(Heads));
+  memcpy(wasFading, k.wasFading, sizeof(wasFading));
+  nextDimStep = k.nextDimStep;
+  now = k.now;
+  flashOn = k.flashOn;
+  headsIdle = k.headsIdle;
+}
+
+uint8_t benchFrames[subFrames][numShiftRegisters];
+
+void headsPass(){                           // the head work of headsTask(), without the refresh hand over
+  now += headsPassMs;
+  flashOn = flashPhase();
+  updateHeads();
+  renderFrames(benchFrames);
+}
+
+// ==================================== timing ==================================== //
+typedef void (*benchPrepare)(int);
+typedef void (*benchCall)(int);
+
+double nowNs(){
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// best of benchRuns runs of calls calls each, prepare(arg) before every run is not timed
+benchResult measure(const std::string &name, benchPrepare prepare, benchCall call, int arg, int calls){
+  benchResult r = {name, 1e30, 0};
+  unsigned long allocs = 0;
+  for (int run=0; run<benchRuns; run++){
+    if (prepare) prepare(arg);
+    unsigned long before = hostAllocs;
+    double start = nowNs();
+    for (int i=0; i<calls; i++) call(arg);
+    double ns = (nowNs() - start) / calls;
+    allocs += hostAllocs - before;
+    if (ns < r.ns) r.ns = ns;
+  }
+  r.allocs = (double)allocs / ((double)benchRuns * calls);
+  return r;
+}
+
+int callsFor(benchPrepare prepare, benchCall call, int arg, int limit){   // calls for a run of about benchRunNs
+  if (prepare) prepare(arg);
+  double start = nowNs();
+  int calls = 0;
+  while ((calls < limit) && (nowNs() - start < benchRunNs / 10)){
+    call(arg);
+    calls++;
+  }
+  return max(1, min(limit, calls * 10));
+}
+
+void callMessage(int m){
+  const messageBench &b = messageBenches[m];
+  memcpy(benchTopic, b.topic.c_str(), b.topic.size() + 1);         // as the client buffer holds it
+  callback(benchTopic, (byte*)b.payload.data(), b.payload.size());
+}
+
+void prepareMessage(int){
+  applyCommands();                          // the slots a run filled, as the next pass would
+  memset(publishDirty, 0, sizeof(publishDirty));
+}
+
+void prepareHeads(int){
+  restoreHeads(kept);
+}
+
+void callHeads(int){
+  headsPass();
+}
+
+void callPublish(int s){
+  publishHead(s);
+}
+
+void callTrueAspect(int s){
+  snprintf(message, sizeof(message), "%s", trueAspect(s));
+}
+
+void callUtcTime(int){
+  String text = utcTime();
+}
+
+// ============================== baseline, compare ============================== //
+bool saveResults(const char* path, const std::vector<benchResult> &results){
+  FILE* f = fopen(path, "w");
+  if (f == NULL) return false;
+  fprintf(f, "# microbench, %d registers: name, ns per call, allocations per call\n", numShiftRegisters);
+  for (size_t i=0; i<results.size(); i++) fprintf(f, "%s\t%.1f\t%.3f\n", results[i].name.c_str(), results[i].ns, results[i].allocs);
+  return fclose(f) == 0;
+}
+
+bool loadResults(const char* path, std::vector<benchResult> &results){
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return false;
+  char line[256];
+  while (fgets(line, sizeof(line), f)){
+    if (line[0] == '#') continue;
+    char* ns = strchr(line, '\t');
+    char* allocs = ns ? strchr(ns + 1, '\t') : NULL;
+    if (allocs == NULL) continue;
+    benchResult r = {std::string(line, ns - line), atof(ns + 1), atof(allocs + 1)};
+    results.push_back(r);
+  }
+  fclose(f);
+  return true;
+}
+
+int compareResults(const std::vector<benchResult> &base, const std::vector<benchResult> &results, double threshold){
+  int regressions = 0;
+  for (size_t i=0; i<results.size(); i++){
+    const benchResult* b = NULL;
+    for (size_t k=0; k<base.size(); k++) if (base[k].name == results[i].name) b = &base[k];
+    if (b == NULL){
+      note("%-24s not in the baseline", results[i].name.c_str());
+      continue;
+    }
+    double change = (b->ns > 0) ? (results[i].ns - b->ns) * 100 / b->ns : 0;
+    bool slower = change > threshold;
+    bool allocating = results[i].allocs > b->allocs + 0.0005;
+    if (slower || allocating) regressions++;
+    printf("  %s %-24s %9.1f ns %+6.1f%%  %6.3f allocs, was %.3f\n", (slower || allocating) ? "FAIL" : "ok  ",
+           results[i].name.c_str(), results[i].ns, change, results[i].allocs, b->allocs);
+  }
+  return regressions;
+}
+
+// ===================================== main ===================================== //
+int main(int argc, char** argv){
+  const char* savePath = NULL;
+  const char* comparePath = NULL;
+  double threshold = 10;
+  std::vector<std::string> wanted;
+  for (int i=1; i<argc; i++){
+    if ((strcmp(argv[i], "--save") == 0) && (i + 1 < argc)) savePath = argv[++i];
+    else if ((strcmp(argv[i], "--compare") == 0) && (i + 1 < argc)) comparePath = argv[++i];
+    else if ((strcmp(argv[i], "--threshold") == 0) && (i + 1 < argc)) threshold = atof(argv[++i]);
+    else if ((strcmp(argv[i], "--runs") == 0) && (i + 1 < argc)) benchRuns = max(1, atoi(argv[++i]));
+    else if (argv[i][0] != '-') wanted.push_back(argv[i]);
+    else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 2;
+    }
+  }
+  std::vector<benchResult> base;
+  if (comparePath && !loadResults(comparePath, base)){
+    fprintf(stderr, "cannot read %s\n", comparePath);
+    return 2;
+  }
+  nameAllHeads();
+  setup();
+  runMs(3000);                              // connected, every head RED
+  addMessages();
+  tracePaused = true;
+
+  std::vector<benchResult> results;
+  for (size_t m=0; m<messageBenches.size(); m++){
+    int calls = callsFor(prepareMessage, callMessage, m, 100000);
+    results.push_back(measure(messageBenches[m].name, prepareMessage, callMessage, m, calls));
+  }
+  for (size_t h=0; h<sizeof(headsBenches)/sizeof(headsBenches[0]); h++){
+    for (int s=0; s<numSignalHeads; s++) sendNow(topicOf("%s/set", Heads.name[s]), headsBenches[h].payload);
+    runMs(headsBenches[h].settleMs);
+    keepHeads(kept);
+    char name[40];
+    snprintf(name, sizeof(name), "%s", headsBenches[h].name);
+    results.push_back(measure(name, prepareHeads, callHeads, 0, 25));   // 100 ms of passes, a fade goes on all along
+    restoreHeads(kept);
+  }
+  runMs(3000);
+  results.push_back(measure("publish head", NULL, callPublish, 0, callsFor(NULL, callPublish, 0, 100000)));
+  results.push_back(measure("trueAspect", NULL, callTrueAspect, 0, callsFor(NULL, callTrueAspect, 0, 100000)));
+  results.push_back(measure("utcTime", NULL, callUtcTime, 0, callsFor(NULL, callUtcTime, 0, 100000)));
+
+  if (!wanted.empty()){
+    std::vector<benchResult> picked;
+    for (size_t i=0; i<results.size(); i++){
+      for (size_t w=0; w<wanted.size(); w++){
+        if (results[i].name.compare(0, wanted[w].size(), wanted[w]) == 0){
+          picked.push_back(results[i]);
+          break;
+        }
+      }
+    }
+    results = picked;
+  }
+  printf("microbench: %d register(s), %d heads, best of %d runs\n", numShiftRegisters, numSignalHeads, benchRuns);
+  int failures = 0;
+  if (comparePath) failures = compareResults(base, results, threshold);
+  else {
+    for (size_t i=0; i<results.size(); i++){
+      printf("  %-24s %9.1f ns %8.3f allocs\n", results[i].name.c_str(), results[i].ns, results[i].allocs);
+    }
+  }
+  if (savePath && !saveResults(savePath, results)){
+    fprintf(stderr, "cannot write %s\n", savePath);
+    failures++;
+  }
+  if (comparePath) printf("%d of %u slower than %.0f%% or allocating more than %s\n", failures, (unsigned)results.size(),
+                          threshold, comparePath);
+  return failures ? 1 : 0;
+}
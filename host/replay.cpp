@@ -0,0 +1,318 @@
+/*
+  Replays a recorded JMRI session into the sketch on the virtual board: the messages go through
+  the broker into callback() at the time they were recorded, loop() runs on the virtual clock,
+  and every frame latched into the shift registers is recorded into a compact binary trace. The
+  trace is saved as a golden trace or compared with one, a change to the fades, the flashing or
+  the renderer shows as the first frame that differs.
+
+  The run goes as fast as this host can, the figures at the end are the layout seconds and the
+  messages it handled per wall second.
+
+  Use:  replay SESSION [--capture] [--save TRACE] [--compare TRACE] [--repeat N] [--no-trace]
+          --capture   SESSION is a dump of the capture server command instead of text
+          --repeat    the session N times in a row, for a longer throughput run
+          --no-trace  the throughput without recording frames
+
+  A text session, as in host/sessions/, has one line per event, ms counted from the session start,
+  which is 3 s after the reset, once the sketch is connected:
+    # comment
+    heads <name> <name> ...     the names of outputs 0, 1, ..., the other outputs are H<n>
+    <ms> <topic> <payload>      a message from JMRI, the payload is the rest of the line
+    end <ms>                    the session ends, the frames run on until then
+  A capture dump brings the head names along, its rendered frames are compared with the ones
+  of the replay. Both play back with the topicPrefix of this build.
+
+  A trace is "JMRF", uint8 version, uint8 shift registers, uint16 0, then per latched frame the
+  timer ticks since the previous one as a varint, a bit mask of the registers that changed and
+  their new bytes.
+*/
+#include <chrono>
+#include "../src/main.cpp"
+#include "harness.h"
+
+const uint32_t sessionStartMs = 3000;       // connected and subscribed by then
+const uint8_t traceVersion = 1;
+
+struct sessionMessage {
+  uint64_t ms;
+  std::string topic;
+  std::string payload;
+};
+std::vector<sessionMessage> session;
+uint64_t sessionEndMs = 0;
+std::vector<std::string> sessionNames;      // per output, empty for the H<n> name
+std::vector<std::vector<uint8_t> > boardFrames;   // rendered frames of a capture dump
+
+// ==================================== sessions ================================== //
+bool readText(const char* path){
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return false;
+  char line[1024];
+  int number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f)){
+    number++;
+    line[strcspn(line, "\r\n")] = 0;
+    char* text = line + strspn(line, " \t");
+    if ((*text == 0) || (*text == '#')) continue;
+    if (strncmp(text, "heads ", 6) == 0){
+      for (char* name = strtok(text + 6, " \t"); name; name = strtok(NULL, " \t")) sessionNames.push_back(name);
+      continue;
+    }
+    unsigned long long ms;
+    int used = 0;
+    if (sscanf(text, "end %llu%n", &ms, &used) == 1){
+      sessionEndMs = ms;
+      continue;
+    }
+    char topic[256];
+    if (sscanf(text, "%llu %255s %n", &ms, topic, &used) < 2){
+      fprintf(stderr, "%s:%d: not a message: %s\n", path, number, text);
+      ok = false;
+      break;
+    }
+    sessionMessage m = {ms, topic, text + used};
+    session.push_back(m);
+    if (ms > sessionEndMs) sessionEndMs = ms;
+  }
+  fclose(f);
+  return ok;
+}
+
+bool readCapture(const char* path){          // the records of src/main.cpp, session capture
+  std::vector<uint8_t> data;
+  if (!loadFile(path, data)) return false;
+  size_t at = 0, frameSize = 0;
+  bool first = true;
+  uint32_t startMs = 0;
+  while (at + 5 <= data.size()){
+    uint32_t ms;
+    memcpy(&ms, &data[at], 4);
+    uint8_t type = data[at + 4];
+    const uint8_t* r = &data[at + 5];
+    size_t left = data.size() - at - 5, length;
+    if (first) startMs = ms;
+    first = false;
+    if ((type == 0) && (left >= 3)){
+      uint16_t registers;
+      memcpy(&registers, r, 2);
+      if (registers != numShiftRegisters){
+        fprintf(stderr, "%s: captured on %u registers, this build has %d\n", path, registers, numShiftRegisters);
+        return false;
+      }
+      frameSize = r[2] * registers;
+      length = 3;
+    } else if ((type == 3) && (left >= 3) && (left >= 3u + r[2])){
+      uint16_t output;
+      memcpy(&output, r, 2);
+      if (output >= sessionNames.size()) sessionNames.resize(output + 1);
+      sessionNames[output].assign((const char*)r + 3, r[2]);
+      length = 3 + r[2];
+    } else if ((type == 1) && (left >= 2) && (left >= 2u + r[0] + r[1])){
+      sessionMessage m = {ms - startMs, std::string((const char*)r + 2, r[0]), std::string((const char*)r + 2 + r[0], r[1])};
+      session.push_back(m);
+      length = 2 + r[0] + r[1];
+    } else if ((type == 2) && frameSize && (left >= frameSize)){
+      boardFrames.push_back(std::vector<uint8_t>(r, r + frameSize));
+      length = frameSize;
+    } else {
+      fprintf(stderr, "%s: bad record of type %u at byte %lu\n", path, type, (unsigned long)at);
+      return false;
+    }
+    at += 5 + length;
+    sessionEndMs = std::max(sessionEndMs, (uint64_t)(ms - startMs) + 1000);
+  }
+  return true;
+}
+
+// ===================================== trace ==================================== //
+std::vector<uint8_t> frameTrace;
+std::vector<uint8_t> traceFrame(numShiftRegisters, 0xFF);   // the registers as the trace last left them
+uint64_t traceTicks = 0;
+unsigned long traceFrames = 0;
+bool recording = true;
+
+void putVarint(std::vector<uint8_t> &out, uint64_t v){
+  while (v >= 0x80){
+    out.push_back((v & 0x7F) | 0x80);
+    v >>= 7;
+  }
+  out.push_back(v);
+}
+
+bool getVarint(const std::vector<uint8_t> &in, size_t &at, uint64_t &v){
+  v = 0;
+  for (int shift=0; (at < in.size()) && (shift < 64); shift += 7){
+    uint8_t b = in[at++];
+    v |= (uint64_t)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+void recordFrame(uint64_t ticks, const uint8_t* frame, int len){
+  traceFrames++;
+  if (!recording) return;
+  putVarint(frameTrace, ticks - traceTicks);
+  traceTicks = ticks;
+  size_t mask = frameTrace.size();
+  frameTrace.resize(frameTrace.size() + (len + 7) / 8, 0);
+  for (int r=0; r<len; r++){
+    if (frame[r] == traceFrame[r]) continue;
+    frameTrace[mask + r / 8] |= 1 << (r % 8);
+    frameTrace.push_back(frame[r]);
+    traceFrame[r] = frame[r];
+  }
+}
+
+void traceHeader(std::vector<uint8_t> &out){
+  const uint8_t header[] = {'J', 'M', 'R', 'F', traceVersion, (uint8_t)numShiftRegisters, 0, 0};
+  out.insert(out.begin(), header, header + sizeof(header));
+}
+
+struct latched {
+  uint64_t ticks;
+  std::vector<uint8_t> frame;
+};
+
+bool decodeTrace(const std::vector<uint8_t> &in, std::vector<latched> &frames){
+  if ((in.size() < 8) || (memcmp(&in[0], "JMRF", 4) != 0) || (in[4] != traceVersion) || (in[5] != (uint8_t)numShiftRegisters)) return false;
+  std::vector<uint8_t> frame(numShiftRegisters, 0xFF);
+  uint64_t ticks = 0, delta;
+  size_t at = 8;
+  while (at < in.size()){
+    if (!getVarint(in, at, delta)) return false;
+    ticks += delta;
+    size_t mask = at;
+    at += (numShiftRegisters + 7) / 8;
+    for (int r=0; r<numShiftRegisters; r++){
+      if ((mask + r / 8 >= in.size()) || !(in[mask + r / 8] & (1 << (r % 8)))) continue;
+      if (at >= in.size()) return false;
+      frame[r] = in[at++];
+    }
+    if (at > in.size()) return false;
+    latched l = {ticks, frame};
+    frames.push_back(l);
+  }
+  return true;
+}
+
+std::string hex(const std::vector<uint8_t> &frame){
+  std::string text;
+  char byte[4];
+  for (size_t i=0; i<frame.size(); i++){
+    snprintf(byte, sizeof(byte), "%02x", frame[i]);
+    text += byte;
+  }
+  return text;
+}
+
+int compareTraces(const char* path, const std::vector<uint8_t> &got){
+  std::vector<uint8_t> data;
+  std::vector<latched> expected, actual;
+  if (!loadFile(path, data) || !decodeTrace(data, expected)){
+    printf("  FAIL %s is not a trace of %d registers\n", path, numShiftRegisters);
+    return 1;
+  }
+  decodeTrace(got, actual);
+  size_t n = std::min(expected.size(), actual.size());
+  for (size_t i=0; i<n; i++){
+    if ((expected[i].ticks == actual[i].ticks) && (expected[i].frame == actual[i].frame)) continue;
+    printf("  FAIL frame %lu differs from %s: %.3f ms %s, golden %.3f ms %s\n", (unsigned long)i, path,
+           actual[i].ticks / (hostTimerHz / 1000.0), hex(actual[i].frame).c_str(),
+           expected[i].ticks / (hostTimerHz / 1000.0), hex(expected[i].frame).c_str());
+    return 1;
+  }
+  if (expected.size() != actual.size()){
+    printf("  FAIL %lu frames, %s has %lu\n", (unsigned long)actual.size(), path, (unsigned long)expected.size());
+    return 1;
+  }
+  printf("  ok   %lu frames the same as %s\n", (unsigned long)actual.size(), path);
+  return 0;
+}
+
+// ===================================== replay =================================== //
+std::vector<std::vector<uint8_t> > rendered;  // frames the replay rendered that changed, for a capture dump
+
+int main(int argc, char** argv){
+  const char* sessionPath = NULL;
+  const char* savePath = NULL;
+  const char* comparePath = NULL;
+  bool capture = false;
+  int repeat = 1;
+  for (int i=1; i<argc; i++){
+    if (strcmp(argv[i], "--capture") == 0) capture = true;
+    else if (strcmp(argv[i], "--no-trace") == 0) recording = false;
+    else if ((strcmp(argv[i], "--save") == 0) && (i + 1 < argc)) savePath = argv[++i];
+    else if ((strcmp(argv[i], "--compare") == 0) && (i + 1 < argc)) comparePath = argv[++i];
+    else if ((strcmp(argv[i], "--repeat") == 0) && (i + 1 < argc)) repeat = std::max(1, atoi(argv[++i]));
+    else if ((argv[i][0] != '-') && (sessionPath == NULL)) sessionPath = argv[i];
+    else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 2;
+    }
+  }
+  if (sessionPath == NULL){
+    fprintf(stderr, "use: replay SESSION [--capture] [--save TRACE] [--compare TRACE] [--repeat N] [--no-trace]\n");
+    return 2;
+  }
+  if (!(capture ? readCapture(sessionPath) : readText(sessionPath))){
+    fprintf(stderr, "%s: cannot read the session\n", sessionPath);
+    return 2;
+  }
+  for (size_t s=0; (s < sessionNames.size()) && (s < (size_t)numSignalHeads); s++){
+    if (!sessionNames[s].empty()) headNames[s] = sessionNames[s].c_str();
+  }
+  nameAllHeads();
+  hostFilter = true;
+  hostOnFrame = recordFrame;
+
+  auto wallStart = std::chrono::steady_clock::now();
+  setup();
+  runMs(sessionStartMs);
+  const uint64_t msTicks = hostTimerHz / 1000;
+  const uint64_t start = hostTicks;
+  const uint64_t length = sessionEndMs + 1;
+  for (int r=0; r<repeat; r++){
+    for (size_t m=0; m<session.size(); m++){
+      hostSend(start + (r * length + session[m].ms) * msTicks, session[m].topic, session[m].payload);
+    }
+  }
+  const uint64_t end = start + repeat * length * msTicks;
+  while (hostTicks < end){
+    uint8_t ready = readyBuffer;
+    pass();
+    if (boardFrames.empty() || (readyBuffer == ready)) continue;
+    std::vector<uint8_t> frames(&frameBuffer[readyBuffer][0][0], &frameBuffer[readyBuffer][0][0] + sizeof(frameBuffer[0]));
+    if (rendered.empty() || (frames != rendered.back())) rendered.push_back(frames);   // changes only, like the capture
+  }
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  double layoutSeconds = (double)hostTicks / hostTimerHz;
+  traceHeader(frameTrace);
+
+#if defined(RENDER_PER_HEAD)
+  const char* renderer = "per head";
+#else
+  const char* renderer = "bit sliced";
+#endif
+  printf("replay %s: %d register(s), %s renderer, %lu messages, %.1f s on the layout\n", sessionPath, numShiftRegisters,
+         renderer, (unsigned long)session.size() * repeat, layoutSeconds);
+  printf("  %.0f layout s per wall s, %.0f messages per wall s, %lu frames latched, trace %lu bytes\n",
+         layoutSeconds / wallSeconds, hostDelivered / wallSeconds, traceFrames, recording ? (unsigned long)frameTrace.size() : 0UL);
+  if (!boardFrames.empty()){                // renders that were skipped on the board may be missing, a report only
+    size_t same = 0;
+    while ((same < boardFrames.size()) && (same < rendered.size()) && (boardFrames[same] == rendered[same])) same++;
+    note("the board rendered %lu frame sets, the replay %lu, the first %lu the same", (unsigned long)boardFrames.size(),
+         (unsigned long)rendered.size(), (unsigned long)same);
+  }
+  int failures = 0;
+  if (savePath && recording){
+    if (saveFile(savePath, frameTrace.data(), frameTrace.size())) printf("  saved %s\n", savePath);
+    else {
+      printf("  FAIL cannot write %s\n", savePath);
+      failures++;
+    }
+  }
+  if (comparePath && recording) failures += compareTraces(comparePath, frameTrace);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,770 @@
+/*
+  The behaviour the change requests promised, checked on the virtual board. Every scenario boots
+  the sketch in a child process of its own, drives it with messages, outages, resets, clock
+  changes and OTA transfers, and checks what the LEDs show and what goes to the broker.
+
+  Use:  scenarios [name ...]        all scenarios without names, exit status 1 on a failed check
+
+  make check runs them on 1 and 8 registers, and the subscriptions scenario again in a build with
+  SUBSCRIBE_ALL. The frame for frame comparison of the renderers is in replay.cpp, the timing of
+  the hot paths in microbench.cpp.
+*/
+#include <sys/stat.h>
+#include "../src/main.cpp"
+#include "harness.h"
+
+// ================================ recording hooks ================================ //
+struct published {
+  uint64_t ticks;
+  std::string topic;
+  std::string payload;
+};
+std::vector<published> publishes;
+
+void recordPublish(const char* topic, const uint8_t* payload, unsigned int length){
+  published p = {hostTicks, topic, std::string((const char*)payload, length)};
+  publishes.push_back(p);
+}
+
+const published* findPublish(const std::string &topic){  // the latest on topic, or NULL
+  for (size_t i=publishes.size(); i>0; i--){
+    if (publishes[i-1].topic == topic) return &publishes[i-1];
+  }
+  return NULL;
+}
+
+std::vector<uint8_t> firstFrame;            // the first frame latched after the reset
+uint64_t firstFrameTicks = 0;
+std::vector<uint8_t> firstLit;              // the first one with a LED lit
+
+void recordFrame(uint64_t ticks, const uint8_t* frame, int len){
+  if (firstFrame.empty()){
+    firstFrame.assign(frame, frame + len);
+    firstFrameTicks = ticks;
+  }
+  if (!firstLit.empty()) return;
+  for (int r=0; r<len; r++){
+    if (frame[r] != 0xFF) firstLit.assign(frame, frame + len);
+  }
+}
+
+unsigned long renders = 0;                  // frames handed to the refresh interrupt
+
+void countingPass(uint32_t us = passUs){
+  uint8_t ready = readyBuffer;
+  loop();
+  if (readyBuffer != ready) renders++;
+  hostAdvanceUs(us);
+}
+
+void countingRunMs(uint64_t ms){
+  uint64_t end = hostTicks + ms * (hostTimerHz / 1000);
+  while (hostTicks < end) countingPass();
+}
+
+bool subscribed(const std::string &filter){
+  for (size_t i=0; i<hostSubscriptions.size(); i++){
+    if (hostSubscriptions[i] == filter) return true;
+  }
+  return false;
+}
+
+std::string scratchDir(){                   // an empty directory for the files of one scenario
+  char path[] = "/tmp/jmrisignal-XXXXXX";
+  const char* made = mkdtemp(path);
+  return made ? made : "";
+}
+
+// ====================================== 007 ===================================== //
+void namesScenario(){
+  headNames[0] = "AMW-A";
+  headNames[1] = "AMW-AB";
+  nameAllHeads();
+  setup();
+  runMs(1000);
+  sendNow(topicOf("AMW-AB/set"), "GREEN");
+  runMs(20);
+  expect((getHead(Heads.aspect, 1) == ASPECT_GREEN) && (getHead(Heads.aspect, 0) == ASPECT_RED),
+         "AMW-AB/set GREEN sets AMW-AB, AMW-A keeps RED");
+  sendNow(topicOf("light/set/AMW-A/yellow"), "ON");
+  runMs(20);
+  expect(getHead(Heads.aspect, 0) == ASPECT_YELLOW, "light/set/AMW-A/yellow ON, the topic level form");
+  sendNow(topicOf("light/set/AMW-AB-flashing"), "ON");
+  runMs(20);
+  expect(getHead(Heads.flash, 1) && !getHead(Heads.flash, 0), "light/set/AMW-AB-flashing ON flashes AMW-AB only");
+  sendNow(topicOf("AMW/set"), "GREEN");
+  runMs(20);
+  expect(getHead(Heads.aspect, 0) == ASPECT_YELLOW, "AMW/set, a prefix of both names, sets neither");
+}
+
+// ================================== 008 and 019 ================================= //
+unsigned long allocsFor(const std::string &topic, const std::string &payload){
+  sendNow(topic, payload);                  // the queue of the broker allocates, not counted
+  unsigned long before = hostAllocs;
+  runMs(100);                               // handled, applied and published
+  return hostAllocs - before;
+}
+
+void allocationScenario(){
+  nameAllHeads();
+  setup();
+  runMs(2000);
+  const char* head = Heads.name[0];
+  const char* other = Heads.name[numSignalHeads - 1];
+  std::string batch = std::string(head) + "=GREEN;" + other + "=FLASHINGRED";
+  struct {
+    const char* form;
+    std::string topic;
+    std::string payload;
+  } forms[] = {
+    {"<head>/set", topicOf("%s/set", head), "GREEN"},
+    {"light/set/<head>-<colour>", topicOf("light/set/%s-red", head), "ON"},
+    {"light/set/<head>/<colour>", topicOf("light/set/%s/yellow", head), "ON"},
+    {"light/set/<head>-flashing", topicOf("light/set/%s-flashing", head), "ON"},
+    {"<head> query", topicOf("%s", head), "?"},
+    {"head of another server", topicOf("elsewhere/set"), "RED"},
+    {"<host>/batch", topicOf("%s/batch", myHostname), batch},
+    {"heads command", topicOf("%s", myHostname), "heads"},
+  };
+  for (size_t f=0; f<sizeof(forms)/sizeof(forms[0]); f++){
+    allocsFor(forms[f].topic, forms[f].payload);         // a first run may set up statics
+    unsigned long allocs = allocsFor(forms[f].topic, forms[f].payload);
+    expect(allocs == 0, "%-28s %lu allocations with its replies", forms[f].form, allocs);
+  }
+  sendNow(topicOf("%s/set", head), "FLASHINGYELLOW");
+  runMs(1000);
+  unsigned long before = hostAllocs;
+  unsigned long passes = 0;
+  uint64_t end = hostTicks + 10ULL * hostTimerHz;
+  while (hostTicks < end){
+    pass();
+    passes++;
+  }
+  expect(hostAllocs == before, "%lu loop() passes with a flashing yellow head, %lu allocations", passes, hostAllocs - before);
+}
+
+// ====================================== 010 ===================================== //
+void subscriptionScenario(){
+  nameAllHeads();
+  hostFilter = true;                        // the broker only sends what was subscribed
+  setup();
+  runMs(2000);
+  unsigned long delivered = hostDelivered;
+  long dropped = msgDropped;
+  int ours = 0, total = 0;
+  uint64_t at = hostTicks;
+  for (int server=0; server<10; server++){  // this one and 9 others with 4 heads each
+    char host[16];
+    snprintf(host, sizeof(host), "HOsrv%02d", server + 10);
+    int heads = server ? 4 : numSignalHeads;
+    for (int h=0; h<heads; h++){
+      char other[16];
+      snprintf(other, sizeof(other), "S%d-%d", server, h);
+      const char* name = server ? other : Heads.name[h];
+      hostSend(at += 5000, topicOf("%s/set", name), "GREEN");
+      hostSend(at += 5000, topicOf("light/set/%s-red", name), "ON");
+      hostSend(at += 5000, topicOf("light/set/%s-flashing", name), "OFF");
+      hostSend(at += 5000, topicOf("%s", name), "?");
+      total += 4;
+      if (server == 0) ours += 4;
+    }
+    if (server){                            // what the other servers publish about themselves
+      hostSend(at += 5000, topicOf("%s/stats", host), "1234");
+      hostSend(at += 5000, topicOf("%s/time", host), "12:00:00");
+      hostSend(at += 5000, topicOf("%s/heads", host), "0:S,1:S,2:S,3:S, total heads:4");
+      total += 3;
+    }
+  }
+  runMs((at - hostTicks) / (hostTimerHz / 1000) + 1000);
+  note("%d messages from JMRI and 10 servers, %d for this server, %u subscriptions",
+       total, ours, (unsigned)hostSubscriptions.size());
+#if defined(SUBSCRIBE_ALL)
+  expect(hostDelivered - delivered == (unsigned long)total, "SUBSCRIBE_ALL: %lu of %d arrive",
+         hostDelivered - delivered, total);
+  expect(msgDropped - dropped == total - ours, "%ld dropped as not ours", msgDropped - dropped);
+#else
+  expect(hostDelivered - delivered == (unsigned long)ours, "%lu of %d arrive", hostDelivered - delivered, total);
+  expect(msgDropped - dropped == 0, "%ld dropped as not ours", msgDropped - dropped);
+#endif
+}
+
+// ================================== 014 and 017 ================================= //
+void batchScenario(){
+  nameAllHeads();
+  setup();
+  runMs(3000);                              // connected, every head RED
+  hostOnPublish = recordPublish;
+  const int route = min(20, numSignalHeads);
+
+  publishes.clear();
+  uint64_t start = hostTicks;
+  for (int s=0; s<route; s++) hostSend(start + s * (hostTimerHz / 1000), topicOf("light/set/%s-green", Heads.name[s]), "ON");
+  runMs(1000);
+  uint64_t last = start;
+  int shown = 0;
+  for (int s=0; s<route; s++){
+    const published* state = findPublish(topicOf("%s", Heads.name[s]));
+    if ((state == NULL) || (state->payload != "GREEN")) continue;
+    shown++;
+    if (state->ticks > last) last = state->ticks;
+  }
+  expect(shown == route, "single messages: every head of a %d head route published GREEN", route);
+  note("single messages: %d in, %u out, the last state after %.0f ms", route, (unsigned)publishes.size(),
+       (double)(last - start) / (hostTimerHz / 1000));
+
+  publishes.clear();
+  std::string batch;
+  for (int s=0; s<route; s++) batch += std::string(s ? ";" : "") + Heads.name[s] + "=RED";
+  start = hostTicks;
+  sendNow(topicOf("%s/batch", myHostname), batch);
+  runMs(1000);
+  int red = 0;
+  for (int s=0; s<route; s++) red += getHead(Heads.aspect, s) == ASPECT_RED;
+  expect(red == route, "batch: all %d heads RED", route);
+  expect((publishes.size() == 1) && (publishes[0].topic == topicOf("%s/batch/state", myHostname)),
+         "batch: 1 in, %u out", (unsigned)publishes.size());
+  if (!publishes.empty()){
+    expect(publishes[0].ticks - start <= 2 * passUs * hostTicksPerUs, "batch: answered after %.1f ms",
+           (double)(publishes[0].ticks - start) / (hostTimerHz / 1000));
+    expect(publishes[0].payload == batch, "batch: the answer lists the aspect every head got");
+  }
+
+  publishes.clear();                        // a single command after the batch, before the pass
+  batch.clear();
+  for (int s=0; s<route; s++) batch += std::string(s ? ";" : "") + Heads.name[s] + "=GREEN";
+  sendNow(topicOf("%s/batch", myHostname), batch);
+  sendNow(topicOf("%s/set", Heads.name[0]), "YELLOW");
+  runMs(1000);
+  const published* state = findPublish(topicOf("%s", Heads.name[0]));
+  expect((state != NULL) && (state->payload == "YELLOW"), "a single command after the batch is published");
+  expect(publishes.size() == 1 + 5, "batch and one single: %u out, the batch reply and one head",
+         (unsigned)publishes.size());
+}
+
+// a batch of every head with long names, the head list and the stats go through the client buffer
+char longNames[numSignalHeads][16];
+
+void bufferScenario(){
+  for (int s=0; s<numSignalHeads; s++){
+    snprintf(longNames[s], sizeof(longNames[s]), "Signal-%04d", s);
+    headNames[s] = longNames[s];
+  }
+  setup();
+  runMs(3000);
+  hostOnPublish = recordPublish;
+  std::string batch;
+  for (int s=0; s<numSignalHeads; s++) batch += std::string(s ? ";" : "") + Heads.name[s] + "=FLASHINGYELLOW";
+  sendNow(topicOf("%s/batch", myHostname), batch);
+  sendNow(topicOf("%s", myHostname), "heads");
+  sendNow(topicOf("%s", myHostname), "stats");
+  runMs(1000);
+  const published* reply = findPublish(topicOf("%s/batch/state", myHostname));
+  expect((reply != NULL) && (reply->payload == batch), "a %u byte batch of all %d heads is answered in full",
+         (unsigned)batch.size(), numSignalHeads);
+  reply = findPublish(topicOf("%s/heads", myHostname));
+  expect((reply != NULL) && (reply->payload.find(" total heads:") != std::string::npos),
+         "the head list goes out, %u bytes", reply ? (unsigned)reply->payload.size() : 0);
+  expect(findPublish(topicOf("%s/stats/tasks", myHostname)) != NULL, "the task stats go out");
+  expect((hostRefused == 0) && (hostTooLong == 0), "client buffer %u bytes: %lu publishes refused, %lu messages dropped",
+         (unsigned)client.getBufferSize(), hostRefused, hostTooLong);
+}
+
+// ================================== 005 and 015 ================================= //
+double isrPerSecond(uint64_t ms){
+  unsigned long runs = hostIsrRuns;
+  runMs(ms);
+  return (hostIsrRuns - runs) * 1000.0 / ms;
+}
+
+void outageScenario(){
+  nameAllHeads();
+  setup();
+  runMs(3000);
+  sendNow(topicOf("%s/set", Heads.name[0]), "FLASHINGYELLOW");
+  double up = isrPerSecond(10000);
+  long lost = netLost;
+  hostBrokerUp = false;
+  double down = isrPerSecond(30000);
+  expect(netLost == lost + 1, "the lost connection is counted");
+  expect((down > up * 0.995) && (down < up * 1.005), "refresh interrupts %.0f/s with the broker, %.0f/s without", up, down);
+  unsigned long connects = hostConnects;
+  hostBrokerUp = true;
+  uint64_t back = hostTicks;
+  while ((netState != NET_UP) && (hostTicks - back < 90ULL * hostTimerHz)) pass();
+  expect(netState == NET_UP, "reconnected %.1f s after the broker came back, %lu attempts in the outage",
+         (hostTicks - back) / (double)hostTimerHz, hostConnects - connects);
+  expect(subscribed(topicOf("%s/set", Heads.name[0])), "subscribed again");
+
+  hostWifiUp = false;
+  down = isrPerSecond(40000);
+  expect((down > up * 0.995) && (down < up * 1.005), "refresh interrupts %.0f/s while WiFi is down", down);
+  hostWifiUp = true;
+  back = hostTicks;
+  while ((netState != NET_UP) && (hostTicks - back < 90ULL * hostTimerHz)) pass();
+  expect(netState == NET_UP, "reconnected %.1f s after WiFi came back", (hostTicks - back) / (double)hostTimerHz);
+}
+
+// ====================================== 020 ===================================== //
+void idleScenario(){
+  nameAllHeads();
+  setup();
+  runMs(5000);                              // warmed up to RED
+  renders = 0;
+  unsigned long idle = idleLoops;
+  countingRunMs(5000);
+  expect(renders == 0, "steady heads: %lu renders in 5 s", renders);
+  expect(idleLoops > idle, "steady heads: %lu idle passes", idleLoops - idle);
+  expect(headsIdle, "steady heads: no head work");
+  sendNow(topicOf("%s/set", Heads.name[0]), "FLASHINGGREEN");
+  countingRunMs(1000);
+  renders = 0;
+  countingRunMs(5000);
+  expect((renders > 0) && (renders < 5 * bcmCycleRate / 2), "a flashing head: %.1f renders per second, %d without the idle skip",
+         renders / 5.0, bcmCycleRate);
+}
+
+// ====================================== 021 ===================================== //
+// Boots in a row on the same RTC memory and file system, every boot in its own child process.
+enum bootStart : uint8_t { BOOT_POWER_ON, BOOT_WARM, BOOT_COLD, BOOT_RTC_CORRUPT, BOOT_BOTH_CORRUPT };
+std::string bootDir;
+bootStart bootKind;
+const char* bootExpect;
+int bootChange;                             // head set GREEN/RED in this boot, -1 for none
+
+void snapshotBoot(){
+  std::vector<uint8_t> data;
+  if ((bootKind != BOOT_POWER_ON) && loadFile(bootDir + "/rtc", data)) memcpy(hostRtc, data.data(), sizeof(hostRtc));
+  if (bootKind == BOOT_COLD) memset(hostRtc, 0, sizeof(hostRtc));
+  if (bootKind >= BOOT_RTC_CORRUPT) hostRtc[snapshotRtcOffset + 2] ^= 0x10;  // an aspect bit, the CRC no longer fits
+  if ((bootKind == BOOT_BOTH_CORRUPT) && loadFile(bootDir + "/fs/heads.bin", data) && (data.size() > 8)){
+    data[8] ^= 0x10;
+    saveFile(bootDir + "/fs/heads.bin", data.data(), data.size());
+  }
+  std::vector<uint8_t> before;
+  bool known = loadFile(bootDir + "/frame", before);
+  hostFsDir = bootDir + "/fs";
+  hostOnFrame = recordFrame;
+  nameAllHeads();
+  setup();
+  expect(strcmp(bootSource, bootExpect) == 0, "heads from %s", bootSource);
+  if (bootKind == BOOT_BOTH_CORRUPT){
+    int lit = 0;
+    for (size_t i=0; i<firstFrame.size(); i++) lit += firstFrame[i] != 0xFF;
+    expect(lit == 0, "the first frame is dark, the heads warm up to red");
+  } else if (known && (bootKind == BOOT_WARM)){
+    expect(firstFrame == before, "the first latched frame shows the aspects from before the reset");
+  }
+  runMs(3000);
+  if (known && (bootKind == BOOT_COLD || bootKind == BOOT_RTC_CORRUPT)){   // after the mount, but no warm up through red
+    expect(firstLit == before, "the first frame with a LED lit shows the aspects from before the reset");
+  }
+  if (bootChange >= 0){
+    aspect_t aspect = (getHead(Heads.aspect, bootChange) == ASPECT_GREEN) ? ASPECT_RED : ASPECT_GREEN;
+    sendNow(topicOf("%s/set", Heads.name[bootChange]), aspectNames[aspect]);
+  }
+  runMs(70000);                             // past the first flash write after boot
+  saveFile(bootDir + "/rtc", hostRtc, sizeof(hostRtc));
+  saveFile(bootDir + "/frame", frameBuffer[readyBuffer][subFrames - 1], numShiftRegisters);  // the longest sub frame, setup() shows it first
+}
+
+void snapshotScenario(){
+  bootDir = scratchDir();
+  mkdir((bootDir + "/fs").c_str(), 0700);
+  struct {
+    bootStart kind;
+    const char* source;
+    int change;
+    const char* title;
+  } boots[] = {
+    {BOOT_POWER_ON, "defaults", 0, "first power on, head 0 set GREEN"},
+    {BOOT_WARM, "rtc", -1, "reset, nothing changes after it"},
+    {BOOT_COLD, "flash", numSignalHeads - 1, "power cycle, the flash copy written after the reset, last head changed"},
+    {BOOT_RTC_CORRUPT, "flash", -1, "reset with a corrupt RTC copy"},
+    {BOOT_BOTH_CORRUPT, "defaults", -1, "reset with both copies corrupt"},
+  };
+  for (size_t b=0; b<sizeof(boots)/sizeof(boots[0]); b++){
+    printf("   boot %d: %s\n", (int)b + 1, boots[b].title);
+    bootKind = boots[b].kind;
+    bootExpect = boots[b].source;
+    bootChange = boots[b].change;
+    harnessFailures += forkRun(snapshotBoot);
+  }
+}
+
+// ====================================== 022 ===================================== //
+// Four servers boot at other times, their crystals drift, SNTP sets each clock with its own
+// error. The flash edges are compared on the true time, before and after SNTP.
+struct server {
+  double bootMs;                            // true time of the reset, ms since midnight
+  double ppm;                               // the board clock runs this much fast
+  double ntpErrorMs;                        // error of the SNTP time
+};
+const server servers[] = {{36000000, 0, 0}, {36000330, 40, 5}, {36000710, -80, -7}, {36001234, 80, 12}};
+const int numServers = sizeof(servers) / sizeof(servers[0]);
+const uint64_t syncAfterMs = 10000;         // SNTP sets the clock this long after the reset
+const uint64_t serverRunMs = 30000;
+std::string edgeDir;
+int edgeServer;
+
+double trueMs(const server &sv){            // the board clock is hostTicks, running ppm fast
+  return sv.bootMs + virtualMs() / (1 + sv.ppm / 1e6);
+}
+
+void flashServer(){
+  const server &sv = servers[edgeServer];
+  hostWallStart = (int64_t)(sv.bootMs + sv.ntpErrorMs);
+  hostWallPpm = -sv.ppm;                    // SNTP corrects the drift of the board clock
+  nameAllHeads();
+  setup();
+  sendNow(topicOf("%s/set", Heads.name[0]), "FLASHINGGREEN");
+  std::vector<double> edges;
+  boolean was = flashOn;
+  while (virtualMs() < serverRunMs){
+    if (!hostWallSet && (virtualMs() >= syncAfterMs)) hostWallSet = true;
+    pass();
+    if (flashOn != was) edges.push_back(trueMs(sv));
+    was = flashOn;
+  }
+  char path[64];
+  snprintf(path, sizeof(path), "/edges%d", edgeServer);
+  saveFile(edgeDir + path, edges.data(), edges.size() * sizeof(double));
+}
+
+double edgeSpread(const std::vector<double> edges[], double from, double to){  // largest distance to server 0
+  double spread = 0;
+  for (size_t e=0; e<edges[0].size(); e++){
+    if ((edges[0][e] < from) || (edges[0][e] > to)) continue;
+    for (int s=1; s<numServers; s++){
+      double nearest = 1e9;
+      for (size_t k=0; k<edges[s].size(); k++) nearest = std::min(nearest, std::abs(edges[s][k] - edges[0][e]));
+      spread = std::max(spread, nearest);
+    }
+  }
+  return spread;
+}
+
+void flashSyncScenario(){
+  edgeDir = scratchDir();
+  std::vector<double> edges[numServers];
+  double firstSynced = 0, lastBoot = 0, firstEnd = 1e12, lastErr = -1e9, firstErr = 1e9;
+  for (int s=0; s<numServers; s++){
+    edgeServer = s;
+    harnessFailures += forkRun(flashServer);
+    std::vector<uint8_t> data;
+    char path[64];
+    snprintf(path, sizeof(path), "/edges%d", s);
+    if (loadFile(edgeDir + path, data)) edges[s].assign((double*)data.data(), (double*)(data.data() + data.size()));
+    lastBoot = std::max(lastBoot, servers[s].bootMs);
+    firstSynced = std::max(firstSynced, servers[s].bootMs + syncAfterMs);
+    firstEnd = std::min(firstEnd, servers[s].bootMs + serverRunMs);
+    lastErr = std::max(lastErr, servers[s].ntpErrorMs);
+    firstErr = std::min(firstErr, servers[s].ntpErrorMs);
+  }
+  double before = edgeSpread(edges, lastBoot + 2000, servers[0].bootMs + syncAfterMs - 1000);
+  double after = edgeSpread(edges, firstSynced + 2000, firstEnd - 1000);
+  double bound = lastErr - firstErr + taskTable[TASK_HEADS].period / 1000.0 + passUs / 1000.0;
+  note("servers booted up to %.0f ms apart, clocks up to 80 ppm off, SNTP errors %.0f to %.0f ms",
+       lastBoot - servers[0].bootMs, firstErr, lastErr);
+  expect(before > 100, "before SNTP the flash edges are up to %.1f ms apart", before);
+  expect(after <= bound, "after SNTP %.1f ms apart, at most the SNTP errors plus one heads period, %.1f ms", after, bound);
+}
+
+// ====================================== 023 ===================================== //
+uint32_t pollLoadUs;
+
+void pollLoad(){
+  hostPollUs = pollLoadUs;
+  nameAllHeads();
+  setup();
+  runMs(3000);
+  sendNow(topicOf("%s/set", Heads.name[0]), "FLASHINGYELLOW");
+  runMs(1000);
+  resetTiming();
+  runMs(10000);
+  const taskStats &heads = taskCounts[TASK_HEADS];
+  const taskStats &net = taskCounts[TASK_NET];
+  note("poll %2u ms: heads %lu runs, %lu missed, latest start %lu us; net %lu runs, longest %lu us", pollLoadUs / 1000,
+       (unsigned long)heads.runs, (unsigned long)heads.misses, (unsigned long)heads.maxLate,
+       (unsigned long)net.runs, (unsigned long)net.maxRun);
+  if (pollLoadUs <= 6000) expect(heads.misses == 0, "poll %u ms: no heads deadline missed", pollLoadUs / 1000);
+  else expect(heads.misses > heads.runs / 2, "poll %u ms: the heads miss their deadline, %lu of %lu",
+              pollLoadUs / 1000, (unsigned long)heads.misses, (unsigned long)heads.runs);
+}
+
+void taskScenario(){
+  const uint32_t polls[] = {0, 3000, 6000, 20000};
+  for (size_t p=0; p<sizeof(polls)/sizeof(polls[0]); p++){
+    pollLoadUs = polls[p];
+    harnessFailures += forkRun(pollLoad);
+  }
+}
+
+// ====================================== 024 ===================================== //
+void otaScenario(){
+  nameAllHeads();
+  setup();
+  runMs(3000);
+  sendNow(topicOf("%s/set", Heads.name[0]), "FLASHINGYELLOW");
+  runMs(2000);
+  const uint32_t image = 400 * 1024, bytesPerMs = 30, sectorUs = 30000;
+  hostOtaSend(image, bytesPerMs, sectorUs);
+  uint32_t runs = taskCounts[TASK_HEADS].runs;
+  uint64_t start = hostTicks;
+  while (hostOtaBytes) pass();              // the whole transfer is in one ArduinoOTA.handle()
+  uint32_t during = taskCounts[TASK_HEADS].runs - runs;
+  otaReport report;
+  ESP.rtcUserMemoryRead(otaRtcOffset, (uint32_t*)&report, sizeof(report));
+  note("%u KB at %u KB/s with %u ms per sector took %.1f s", image / 1024, bytesPerMs, sectorUs / 1000,
+       (hostTicks - start) / (double)hostTimerHz);
+  expect(during > 0, "the heads ran %u times during the transfer", during);
+  expect((report.magic == otaMagic) && (report.bytes == image) && (report.error == otaNoError),
+         "the report waits in RTC memory for the restart");
+  uint32_t bound = 1460 / bytesPerMs + sectorUs / 1000 + 1;
+  expect(report.maxStall <= bound, "the heads waited %u ms at most, one chunk and one sector write is %u",
+         report.maxStall, bound);
+  note("throughput in the report %.1f KB/s", report.ms ? report.bytes / (double)report.ms : 0.0);
+}
+
+// ====================================== 025 ===================================== //
+struct imageHead {
+  int output;
+  const char* name;
+  uint8_t bulb;
+};
+enum imageDamage : uint8_t { IMAGE_GOOD, IMAGE_CRC, IMAGE_INDEX_FULL, IMAGE_SLOT_RANGE, IMAGE_SLOT_UNNAMED, IMAGE_FLASH_ODD };
+
+bool writeImage(const std::string &path, const std::vector<imageHead> &heads, imageDamage damage = IMAGE_GOOD){
+  std::string arena;
+  std::vector<configHead> records;
+  for (size_t h=0; h<heads.size(); h++){
+    configHead r = {(uint16_t)heads[h].output, (uint16_t)arena.size(), heads[h].bulb, 0};
+    records.push_back(r);
+    arena += heads[h].name;
+    arena += '\0';
+  }
+  uint16_t prefix = arena.size();
+  arena += "JMRI/signal/";
+  arena += '\0';
+  std::vector<int16_t> index(headIndexSizeFor(numSignalHeads), -1);
+  for (size_t h=0; h<heads.size(); h++){                  // like buildHeadIndex()
+    uint32_t slot = nameHash(heads[h].name, strlen(heads[h].name)) & (index.size() - 1);
+    while (index[slot] >= 0) slot = (slot + 1) & (index.size() - 1);
+    index[slot] = heads[h].output;
+  }
+  int unnamed = 0;
+  for (size_t h=0; h<heads.size(); h++) if (heads[h].output == unnamed) { unnamed++; h = (size_t)-1; }
+  for (size_t i=0; i<index.size(); i++){
+    if (index[i] >= 0) continue;
+    if (damage == IMAGE_INDEX_FULL) index[i] = heads[0].output;
+    if (damage == IMAGE_SLOT_RANGE) index[i] = numSignalHeads;
+    if (damage == IMAGE_SLOT_UNNAMED) index[i] = unnamed;
+    if (damage != IMAGE_INDEX_FULL) break;
+  }
+  std::vector<uint8_t> body;
+  body.insert(body.end(), (uint8_t*)records.data(), (uint8_t*)(records.data() + records.size()));
+  body.insert(body.end(), (uint8_t*)index.data(), (uint8_t*)(index.data() + index.size()));
+  body.insert(body.end(), arena.begin(), arena.end());
+  configHeader header = {configMagic, configVersion, numSignalHeads, (uint16_t)heads.size(), (uint16_t)index.size(),
+                         (uint16_t)arena.size(), prefix,
+                         (uint16_t)((damage == IMAGE_FLASH_ODD) ? 1024 : 1000), B11000000, 0, crc32Update(0, body.data(), body.size())};
+  if (damage == IMAGE_CRC) body[body.size() - 3] ^= 1;
+  std::vector<uint8_t> image((uint8_t*)&header, (uint8_t*)(&header + 1));
+  image.insert(image.end(), body.begin(), body.end());
+  return saveFile(path, image.data(), image.size());
+}
+
+std::string configDir;
+
+void configLoad(){
+  hostFsDir = configDir;
+  hostOnPublish = recordPublish;
+  nameAllHeads();
+  setup();
+  expect(strcmp(configSource, configFile) == 0, "config from %s", configSource);
+  expect((findHead("Alpha", 5) == 0) && (findHead("Gamma", 5) == 2) && (Heads.name[1] == NULL),
+         "heads Alpha on output 0 and Gamma on 2, output 1 unused");
+  expect(Heads.bulb[2] == BULB_LED, "Gamma imitates an LED");
+  runMs(3000);
+  expect(subscribed(topicOf("Alpha/set")) && !subscribed(topicOf("%s/set", headNames[1])),
+         "subscribed to the heads of the image only");
+
+  sendNow(topicOf("Alpha/set"), "GREEN");
+  sendNow(topicOf("Gamma/set"), "YELLOW");
+  runMs(3000);
+  std::vector<imageHead> next = {{0, "Alpha", BULB_MINIATURE}, {1, "Beta", BULB_MINIATURE}};
+  writeImage(configDir + configFile, next);
+  unsigned long connects = hostConnects;
+  sendNow(topicOf("%s", myHostname), "reload");
+  runMs(100);
+  expect((getHead(Heads.currentAspect, 0) == ASPECT_GREEN) && (getHeadBits(Heads.dimPattern, 8, 0) == 255),
+         "reload: Alpha keeps its output and stays GREEN");
+  expect(getHead(Heads.aspect, 2) == ASPECT_DARK, "reload: output 2 lost Gamma and cools down to dark");
+  expect(getHead(Heads.aspect, 1) == ASPECT_RED, "reload: Beta on output 1 warms up to red");
+  const published* reply = findPublish(topicOf("%s/config", myHostname));
+  expect((reply != NULL) && (reply->payload.compare(0, 19, "/config.bin: 2 head") == 0), "reload: %s",
+         reply ? reply->payload.c_str() : "no reply");
+  runMs(5000);
+  expect((hostConnects > connects) && subscribed(topicOf("Beta/set")) && !subscribed(topicOf("Gamma/set")),
+         "reload: connected again with the topics of Beta instead of Gamma");
+
+  writeImage(configDir + configFile, next, IMAGE_CRC);
+  sendNow(topicOf("%s", myHostname), "reload");
+  runMs(100);
+  reply = findPublish(topicOf("%s/config", myHostname));
+  expect((reply != NULL) && (reply->payload.compare(0, 8, "no valid") == 0) && (findHead("Beta", 4) == 1),
+         "reload of a corrupt image: %s", reply ? reply->payload.c_str() : "no reply");
+}
+
+imageDamage badIndex;
+
+void configBadIndex(){
+  hostFsDir = configDir;
+  nameAllHeads();
+  setup();
+  expect(strcmp(configSource, "built in") == 0, "refused, config %s", configSource);
+  expect(findHead("Nobody", 6) == -1, "a lookup of an unknown name ends");
+}
+
+void configBootOrder(){                     // a warm boot with the snapshot in RTC memory, a slow mount
+  std::vector<uint8_t> data;
+  if (loadFile(configDir + "/rtc", data)) memcpy(hostRtc, data.data(), sizeof(hostRtc));
+  hostFsDir = configDir;
+  hostMountUs = 40000;
+  hostOnFrame = recordFrame;
+  hostOnPublish = recordPublish;
+  nameAllHeads();
+  setup();
+  expect(strcmp(bootSource, "rtc") == 0, "heads from %s", bootSource);
+  expect(firstFrameTicks < hostMountUs * hostTicksPerUs, "the snapshot showed %.1f ms after the reset, before the %u ms mount",
+         firstFrameTicks / (double)(hostTimerHz / 1000), hostMountUs / 1000);
+  expect((getHead(Heads.currentAspect, 0) == ASPECT_GREEN) && (getHead(Heads.currentAspect, 1) == ASPECT_YELLOW),
+         "Alpha GREEN and Beta, which only the image names, YELLOW");
+  runMs(5000);
+  const published* boot = findPublish(topicOf("%s/stats/boot", myHostname));
+  expect((boot != NULL) && (boot->payload.find("mount 40 ms") != std::string::npos), "/stats/boot: %s",
+         boot ? boot->payload.c_str() : "not published");
+}
+
+void configBeforeReset(){
+  hostFsDir = configDir;
+  nameAllHeads();
+  setup();
+  runMs(3000);
+  sendNow(topicOf("Alpha/set"), "GREEN");
+  sendNow(topicOf("Beta/set"), "YELLOW");
+  runMs(3000);
+  saveFile(configDir + "/rtc", hostRtc, sizeof(hostRtc));
+}
+
+void configScenario(){
+  configDir = scratchDir();
+  std::vector<imageHead> heads = {{0, "Alpha", BULB_MINIATURE}, {2, "Gamma", BULB_LED}};
+  writeImage(configDir + configFile, heads);
+  printf("   load at boot and reload\n");
+  harnessFailures += forkRun(configLoad);
+  const char* damages[] = {"", "", "an index without an empty slot", "a slot past the outputs", "a slot at an unused output",
+                           "flash 1024, 84375 flash times a day, two lit ones at midnight"};
+  for (int d=IMAGE_INDEX_FULL; d<=IMAGE_FLASH_ODD; d++){
+    printf("   boot with %s\n", damages[d]);
+    writeImage(configDir + configFile, heads, (imageDamage)d);
+    harnessFailures += forkRun(configBadIndex);
+  }
+  printf("   warm boot with the image, the mount takes 40 ms\n");
+  writeImage(configDir + configFile, {{0, "Alpha", BULB_MINIATURE}, {1, "Beta", BULB_MINIATURE}});
+  harnessFailures += forkRun(configBeforeReset);
+  harnessFailures += forkRun(configBootOrder);
+}
+
+// ====================================== 012 ===================================== //
+// The command arrives in the client buffer, which the stats publishes reuse before the reset.
+uint32_t loopsCounted(){
+  uint32_t total = 0;
+  for (int b=0; b<loopBuckets; b++) total += loopHist[b];
+  return total;
+}
+
+void statsResetScenario(){
+  nameAllHeads();
+  setup();
+  runMs(5000);
+  sendNow(topicOf("%s/set", Heads.name[0]), "FLASHINGGREEN");
+  runMs(5000);
+  uint32_t loops = loopsCounted(), runs = taskCounts[TASK_HEADS].runs, calls = sections[SECTION_HEADS].calls;
+  hostOnPublish = recordPublish;
+  unsigned long delivered = hostDelivered;
+  sendNow(topicOf("%s", myHostname), "stats reset");
+  while (hostDelivered == delivered) pass();               // the pass that handled it, the tasks after it count again
+  expect(findPublish(topicOf("%s/stats/tasks", myHostname)) != NULL, "stats reset publishes the stats first");
+  expect((loopsCounted() <= 1) && (taskCounts[TASK_HEADS].runs <= 1) && (sections[SECTION_HEADS].calls <= 1),
+         "stats reset over MQTT: %u loops, %u heads runs, %u heads sections counted, before %u, %u, %u",
+         loopsCounted(), (unsigned)taskCounts[TASK_HEADS].runs, (unsigned)sections[SECTION_HEADS].calls,
+         loops, (unsigned)runs, (unsigned)calls);
+  expect(msSince(statsSince) <= 1, "the statistics start over at the command");
+}
+
+// ================================== 011 and 015 ================================= //
+void wrapFade(){
+  hostMillisStart = 0xFFFF0000;             // 65 s before millis() wraps
+  nameAllHeads();
+  setup();
+  while (millis() < 0xFFFFFF80) pass();
+  sendNow(topicOf("%s/set", Heads.name[0]), "GREEN");
+  runMs(3000);
+  expect((getHead(Heads.currentAspect, 0) == ASPECT_GREEN) && (getHeadBits(Heads.dimPattern, 8, 0) == 255),
+         "a fade started 128 ms before the millis() wrap ends at full brightness");
+}
+
+void wrapReconnect(){
+  hostMillisStart = 0xFFFF0000;
+  hostBrokerUp = false;
+  nameAllHeads();
+  setup();
+  while ((millis() > 0x10000) || (millis() < 1000)) pass();
+  hostBrokerUp = true;
+  uint64_t back = hostTicks;
+  while ((netState != NET_UP) && (hostTicks - back < 90ULL * hostTimerHz)) pass();
+  expect(netState == NET_UP, "the broker, down over the millis() wrap, is connected %.1f s after it is back",
+         (hostTicks - back) / (double)hostTimerHz);
+}
+
+void wrapScenario(){
+  harnessFailures += forkRun(wrapFade);
+  harnessFailures += forkRun(wrapReconnect);
+}
+
+// =================================== scenarios ================================== //
+struct scenario {
+  const char* name;
+  const char* title;
+  void (*run)();
+};
+const scenario scenarios[] = {
+  {"names", "007: heads found by their exact name, both light/set forms", namesScenario},
+  {"allocations", "008, 019: no heap allocations per message or loop() pass", allocationScenario},
+  {"subscriptions", "010: 10 servers on one broker, only our topics arrive", subscriptionScenario},
+  {"batch", "014, 017: a route in single messages and in one batch", batchScenario},
+  {"buffer", "014: the client buffer holds the longest batch and list", bufferScenario},
+  {"outage", "005, 015: broker and WiFi outages, the LEDs keep being refreshed", outageScenario},
+  {"idle", "020: no rendering while the heads are steady", idleScenario},
+  {"snapshot", "021: the aspects come back after a reset or power cycle", snapshotScenario},
+  {"flashsync", "022: servers flash in step on the NTP clock", flashSyncScenario},
+  {"tasks", "023: the heads keep their deadline under a slow broker poll", taskScenario},
+  {"ota", "024: the heads run during an OTA transfer, the report waits for the restart", otaScenario},
+  {"config", "025: /config.bin at boot, on reload, broken images", configScenario},
+  {"statsreset", "012: stats reset over MQTT clears the counters", statsResetScenario},
+  {"wrap", "011, 015: fades and reconnects over the millis() wrap", wrapScenario},
+};
+
+int main(int argc, char** argv){
+  int failures = 0, run = 0;
+  for (size_t i=0; i<sizeof(scenarios)/sizeof(scenarios[0]); i++){
+    bool wanted = (argc == 1);
+    for (int a=1; a<argc; a++) wanted = wanted || (strcmp(argv[a], scenarios[i].name) == 0);
+    if (!wanted) continue;
+    printf("%s, %s\n", scenarios[i].name, scenarios[i].title);
+    failures += forkRun(scenarios[i].run);
+    run++;
+  }
+  printf("%d scenarios on %d registers, %d failed checks\n", run, numShiftRegisters, failures);
+  return failures ? 1 : 0;
+}
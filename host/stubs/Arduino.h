@@ -0,0 +1,125 @@
+/*
+  Host stand-in for the Arduino core, only what the sketch uses.
+
+  Time comes from the virtual board in host/board.h: millis(), micros() and delay() follow its
+  clock, delay() moves it on and runs the refresh interrupt meanwhile.
+*/
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define MSBFIRST 1
+#define LED_BUILTIN 2
+#define IRAM_ATTR
+#define ICACHE_RAM_ATTR
+
+#define B00 0
+#define B01 1
+#define B10 2
+#define B11 3
+#define B11000000 192
+
+#define bitRead(value, bit) (((value) >> (bit)) & 1)
+
+template <typename T> inline T min(T a, T b){ return (b < a) ? b : a; }
+template <typename T> inline T max(T a, T b){ return (a < b) ? b : a; }
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+inline void yield(){}
+inline void noInterrupts(){}
+inline void interrupts(){}
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+// the Arduino String, kept in a std::string; short ones stay without allocation like on the core
+class String {
+public:
+  String(){}
+  String(const char* text) : s(text ? text : ""){}
+  String(char c) : s(1, c){}
+  String(int value) : s(std::to_string(value)){}
+  String(unsigned int value) : s(std::to_string(value)){}
+  String(long value) : s(std::to_string(value)){}
+  String(unsigned long value) : s(std::to_string(value)){}
+  String(float value){ number(value); }
+  String(double value){ number(value); }
+  String &operator+=(const String &other){ s += other.s; return *this; }
+  String &operator+=(const char* text){ s += text; return *this; }
+  String &operator+=(char c){ s += c; return *this; }
+  String &operator+=(int value){ s += std::to_string(value); return *this; }
+  String &operator+=(unsigned int value){ s += std::to_string(value); return *this; }
+  String &operator+=(long value){ s += std::to_string(value); return *this; }
+  String &operator+=(unsigned long value){ s += std::to_string(value); return *this; }
+  friend String operator+(const String &a, const String &b){ String r(a); r += b; return r; }
+  friend String operator+(const String &a, const char* b){ String r(a); r += b; return r; }
+  bool operator==(const String &other) const { return s == other.s; }
+  const char* c_str() const { return s.c_str(); }
+  unsigned int length() const { return s.size(); }
+private:
+  void number(double value){            // two decimals, like String(float) on the core
+    char text[32];
+    snprintf(text, sizeof(text), "%.2f", value);
+    s = text;
+  }
+  std::string s;
+};
+
+class IPAddress {
+public:
+  String toString() const { return "127.0.0.1"; }
+};
+
+class HardwareSerial {                  // output is dropped, or written to stderr with hostSerialEcho
+public:
+  void begin(unsigned long){}
+  size_t print(const char* text);
+  size_t print(const String &text){ return print(text.c_str()); }
+  size_t print(long value){ return print(String(value)); }
+  size_t print(const IPAddress &ip){ return print(ip.toString()); }
+  size_t println(){ return print("\n"); }
+  template <typename T> size_t println(const T &value){ return print(value) + println(); }
+  size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+  size_t write(uint8_t c){ return write(&c, 1); }
+  size_t write(const uint8_t* data, size_t length);
+  int availableForWrite();
+};
+extern HardwareSerial Serial;
+
+#define RTC_USER_MEM_WORDS 128
+class EspClass {
+public:
+  uint32_t getChipId(){ return 0x00E5B266; }
+  uint8_t getCpuFreqMHz(){ return 80; }
+  uint32_t getCycleCount();
+  uint32_t getFreeHeap();
+  uint32_t getMaxFreeBlockSize();
+  uint8_t getHeapFragmentation(){ return 0; }
+  uint32_t getFreeContStack(){ return 4096; }
+  String getResetReason();
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size);
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size);
+  void restart(){}
+};
+extern EspClass ESP;
+
+inline void configTime(const char*, const char*){}   // the wall clock is set by the harness
+
+#endif
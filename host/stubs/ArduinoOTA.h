@@ -0,0 +1,37 @@
+/*
+  Host stand-in for ArduinoOTA. handle() receives the transfer queued with hostOtaSend() in one
+  call, like the real one, see board.cpp.
+*/
+#ifndef ARDUINOOTA_H
+#define ARDUINOOTA_H
+
+#include <Arduino.h>
+#include <functional>
+
+typedef enum {
+  OTA_AUTH_ERROR,
+  OTA_BEGIN_ERROR,
+  OTA_CONNECT_ERROR,
+  OTA_RECEIVE_ERROR,
+  OTA_END_ERROR
+} ota_error_t;
+
+class ArduinoOTAClass {
+public:
+  void setPort(uint16_t){}
+  void setHostname(const char*){}
+  void setPassword(const char*){}
+  void onStart(std::function<void()> fn){ startFn = fn; }
+  void onEnd(std::function<void()> fn){ endFn = fn; }
+  void onProgress(std::function<void(unsigned int, unsigned int)> fn){ progressFn = fn; }
+  void onError(std::function<void(ota_error_t)> fn){ errorFn = fn; }
+  void begin(){}
+  void handle();
+private:
+  std::function<void()> startFn, endFn;
+  std::function<void(unsigned int, unsigned int)> progressFn;
+  std::function<void(ota_error_t)> errorFn;
+};
+extern ArduinoOTAClass ArduinoOTA;
+
+#endif
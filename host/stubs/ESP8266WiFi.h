@@ -0,0 +1,28 @@
+/*
+  Host stand-in for the ESP8266 WiFi library. The access point is there while hostWifiUp is set.
+*/
+#ifndef ESP8266WIFI_H
+#define ESP8266WIFI_H
+
+#include <Arduino.h>
+
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 6
+#define WIFI_STA 1
+#define WIFI_LIGHT_SLEEP 1
+#define WIFI_MODEM_SLEEP 2
+
+class WiFiClass {
+public:
+  void mode(int){}
+  void begin(const char*, const char*){}
+  void disconnect(){}
+  void setAutoReconnect(bool){}
+  void setSleepMode(int){}
+  int status();
+  IPAddress localIP(){ return IPAddress(); }
+  int hostByName(const char*, IPAddress &, uint32_t){ return status() == WL_CONNECTED; }
+};
+extern WiFiClass WiFi;
+
+#endif
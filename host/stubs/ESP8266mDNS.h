@@ -0,0 +1 @@
+// Host stand-in, the sketch includes it but does not use it.
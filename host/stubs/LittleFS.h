@@ -0,0 +1,35 @@
+/*
+  Host stand-in for LittleFS, the files live in the directory hostFsDir. Without one, begin()
+  fails like on a board without a file system.
+*/
+#ifndef LITTLEFS_H
+#define LITTLEFS_H
+
+#include <Arduino.h>
+
+class File {
+public:
+  File(){}
+  explicit File(FILE* file) : f(file){}
+  operator bool() const { return f != NULL; }
+  size_t read(uint8_t* data, size_t length){ return fread(data, 1, length, f); }
+  size_t write(const uint8_t* data, size_t length);
+  bool seek(uint32_t position){ return fseek(f, position, SEEK_SET) == 0; }
+  size_t size();
+  void close(){
+    if (f) fclose(f);
+    f = NULL;
+  }
+private:
+  FILE* f = NULL;
+};
+
+class LittleFSClass {
+public:
+  bool begin();
+  File open(const char* path, const char* mode);
+  bool rename(const char* from, const char* to);
+};
+extern LittleFSClass LittleFS;
+
+#endif
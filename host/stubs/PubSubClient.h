@@ -0,0 +1,41 @@
+/*
+  Host stand-in for PubSubClient, talking to the broker of the virtual board (board.h).
+
+  Like the library it takes one packet per loop(), hands the callback the topic and payload in
+  its own buffer, drops packets larger than the buffer and refuses such publishes.
+*/
+#ifndef PUBSUBCLIENT_H
+#define PUBSUBCLIENT_H
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+
+#define MQTT_MAX_HEADER_SIZE 5
+#define MQTT_MAX_PACKET_SIZE 256
+
+class PubSubClient {
+public:
+  typedef void (*callback_t)(char*, uint8_t*, unsigned int);
+  PubSubClient(const char*, uint16_t, callback_t fn, WiFiClient &) : callback(fn){}
+  ~PubSubClient(){ free(buffer); }
+  PubSubClient &setServer(const char*, uint16_t){ return *this; }
+  PubSubClient &setServer(IPAddress, uint16_t){ return *this; }
+  PubSubClient &setCallback(callback_t fn){ callback = fn; return *this; }
+  PubSubClient &setSocketTimeout(uint16_t){ return *this; }
+  bool setBufferSize(uint16_t size);
+  uint16_t getBufferSize(){ return bufferSize; }
+  bool connect(const char* id, const char* user, const char* pass);
+  bool connected();
+  void disconnect(){ linked = false; }
+  bool loop();
+  bool publish(const char* topic, const char* payload){ return publish(topic, (const uint8_t*)payload, strlen(payload)); }
+  bool publish(const char* topic, const uint8_t* payload, unsigned int length);
+  bool subscribe(const char* topic);
+private:
+  callback_t callback;
+  bool linked = false;
+  uint16_t bufferSize = MQTT_MAX_PACKET_SIZE;
+  uint8_t* buffer = NULL;
+};
+
+#endif
@@ -0,0 +1,6 @@
+// Host stand-in for the SSID_access.h of src/, taken when src/ has none
+#define MY_SSID "host"
+#define SSID_PSW "host"
+#define OTA_PSW myHostname
+#define MQTT_USER "host"
+#define MQTT_PASSWORD "host"
@@ -0,0 +1,14 @@
+/*
+  Host stand-in for the WiFi client, PubSubClient does the broker side.
+*/
+#ifndef WIFICLIENT_H
+#define WIFICLIENT_H
+
+#include <Arduino.h>
+
+class WiFiClient {
+public:
+  void setTimeout(unsigned long){}
+};
+
+#endif
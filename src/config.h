@@ -0,0 +1,78 @@
+/*
+  Image format of the head configuration, shared by the sketch and the compiler in tools/configbuild.cpp.
+
+  configbuild turns a text layout into config.bin, which goes into the LittleFS of the server as
+  /config.bin. The sketch loads it at boot, and with the reload server command, straight into its
+  tables: the head records into the head table, the name index into headIndex and the names and
+  the topic prefix into one string arena the head names point into. Nothing is parsed on the board.
+
+  The image, little endian like the ESP8266, without padding:
+    configHeader
+    configHead[heads]               one per named output
+    int16_t index[indexSize]        head number per slot of the name index, -1 for an empty slot,
+                                    at least one slot empty and every other one a head with a record
+    char arena[arenaSize]           the 0 terminated names and the topic prefix
+*/
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+const uint32_t configMagic = 0x4746434A;  // "JCFG"
+const uint16_t configVersion = 1;   // raised when the layout changes, the sketch refuses other versions
+const uint32_t configDayMs = 86400000UL;  // a day holds an even number of flash times, see configFlashTimeValid()
+
+struct __attribute__((packed)) configHeader {  // 24 bytes
+  uint32_t magic;                   // configMagic
+  uint16_t version;                 // configVersion
+  uint16_t outputs;                 // numSignalHeads of the sketch, 4 per shift register
+  uint16_t heads;                   // configHead records that follow
+  uint16_t indexSize;               // slots of the name index, headIndexSizeFor(outputs)
+  uint16_t arenaSize;               // bytes of names and prefix, at most configArenaSizeFor(outputs)
+  uint16_t prefix;                  // arena offset of the topic prefix
+  uint16_t flashTime;               // ms per flash phase
+  uint8_t yellowCycle;              // sub frames that show green for yellow
+  uint8_t reserved;
+  uint32_t crc;                     // CRC-32 of everything after the header
+};
+
+struct __attribute__((packed)) configHead {  // 6 bytes
+  uint16_t output;                  // head number, register output/4, pins (output%4)*2 and (output%4)*2+1
+  uint16_t name;                    // arena offset of the name
+  uint8_t bulb;                     // bulb_t of the sketch
+  uint8_t reserved;
+};
+
+constexpr int headIndexSizeFor(int heads, int size = 2){       // a power of 2, at most half full
+  return (size >= 2 * heads) ? size : headIndexSizeFor(heads, size * 2);
+}
+
+constexpr int configArenaSizeFor(int heads){                    // 11 characters a name on average and the prefix
+  return heads * 12 + 32;
+}
+
+// flashPhase() lights the heads in the even flash times since midnight. An even number of them
+// in a day ends the day dark, so midnight goes on with the light: 1000 ms is fine, 1024 ms
+// divides a day 84375 times and would show two lit times in a row.
+inline bool configFlashTimeValid(uint32_t flashTime){
+  return (flashTime != 0) && ((configDayMs % flashTime) == 0) && (((configDayMs / flashTime) % 2) == 0);
+}
+
+inline uint32_t nameHash(const char* name, int len){            // FNV-1a
+  uint32_t hash = 2166136261UL;
+  for (int i=0; i<len; i++) hash = (hash ^ (uint8_t)name[i]) * 16777619UL;
+  return hash;
+}
+
+inline uint32_t crc32Update(uint32_t crc, const void* data, size_t len){  // CRC-32, bitwise, start with 0
+  const uint8_t* bytes = (const uint8_t*)data;
+  crc = ~crc;
+  while (len--){
+    crc ^= *bytes++;
+    for (int b=0; b<8; b++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+#endif
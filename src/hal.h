@@ -0,0 +1,198 @@
+/*
+  Thin hardware abstraction layer for the signal server.
+
+  Everything the sketch needs from the board goes through these few calls:
+  the clock, the shift register output, the built-in LED and MQTT publish/subscribe.
+  main.cpp does not call millis(), shiftOut(), digitalWrite() or client.publish()
+  directly any more, so porting the logic (or running it against a virtual clock
+  and a recording shift register) only means providing another version of this file.
+  The Linux build in host/ does that with host/hal_host.h.
+*/
+#ifndef HAL_H
+#define HAL_H
+
+#if defined(HOST_BUILD)
+#include <hal_host.h>
+#else
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include <sys/time.h>
+
+#ifndef OUTPUT_BITBANG              // define OUTPUT_BITBANG (here or as build flag) for the bit banged fallback
+#define OUTPUT_SPI                  // shift registers clocked by the ESP8266 hardware SPI (HSPI)
+#endif
+
+#if defined(OUTPUT_SPI)
+#include <SPI.h>
+#endif
+
+// =============================== Pin Definitions =============================== //
+#if defined(OUTPUT_SPI)
+const int dataPin = D7;             // pin D7 on NodeMCU boards, HSPI MOSI for data bits
+const int latchPin = D8;            // pin D8 on NodeMCU boards for latching
+const int clockPin = D5;            // pin D5 on NodeMCU boards, HSPI SCLK for clock pulse
+const uint32_t spiClock = 4000000;  // 4 MHz is well within what a SN74HC595 takes
+#else
+const int dataPin = D6;             // pin D6 on NodeMCU boards for data bits
+const int latchPin = D7;            // pin D7 on NodeMCU boards for latching
+const int clockPin = D8;            // pin D8 on NodeMCU boards for clock pulse
+#endif
+
+extern PubSubClient client;         // defined in main.cpp
+
+const uint32_t halTimerHz = 5000000;  // timer1 clock, 80 MHz / 16
+#if defined(OUTPUT_SPI)
+constexpr uint32_t halShiftTicks(uint32_t bits) {   // timer ticks to shift out a frame
+  return (bits * (uint64_t)halTimerHz + spiClock - 1) / spiClock;
+}
+const int halLatchDelay = 1;        // a frame sent by halShiftOutIsr() shows from the next tick on
+#else
+constexpr uint32_t halShiftTicks(uint32_t bits) {   // about 1.6 us per bit for three digitalWrite() calls
+  return bits * 8;
+}
+const int halLatchDelay = 0;        // a frame sent by halShiftOutIsr() shows right away
+#endif
+
+// ==================================== Clock ==================================== //
+inline unsigned long halMillis() {
+  return millis();
+}
+
+inline uint32_t halMicros() {       // wraps after 71 minutes, compare differences only
+  return micros();
+}
+
+// ms since midnight UTC on the clock SNTP keeps, interpolated to the us between syncs,
+// false while SNTP has not set the clock yet
+inline boolean halWallClockMs(uint32_t &ms) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec < 1600000000) return false;   // before 2020, still counting from boot
+  ms = (tv.tv_sec % 86400) * 1000 + tv.tv_usec / 1000;
+  return true;
+}
+
+inline uint32_t IRAM_ATTR halCycles() {   // CPU cycle counter, a single instruction, wraps after 53 s at 80 MHz
+  return ESP.getCycleCount();
+}
+
+// ================================ GPIO / output ================================ //
+// halShiftOut() writes and latches a frame right away.
+// halShiftOutIsr() may only start the transfer: what it sent shows after the next halLatchIsr(),
+// which the refresh interrupt calls on every tick. Both send frame[0] last, so it ends up
+// in the first register of the chain.
+#if defined(OUTPUT_SPI)
+static volatile boolean halLatchPending = false;  // a transfer was started and is not latched yet
+
+inline void halInitPins() {
+  pinMode(LED_BUILTIN, OUTPUT);
+  pinMode(latchPin, OUTPUT);
+  SPI.begin();
+  SPI.setFrequency(spiClock);
+  SPI.setDataMode(SPI_MODE0);
+  SPI.setBitOrder(MSBFIRST);
+}
+
+inline void halShiftOut(const uint8_t* frame, int len) {
+  digitalWrite(latchPin, LOW);
+  for (int r = len - 1; r >= 0; r--) SPI.transfer(frame[r]);
+  digitalWrite(latchPin, HIGH);
+}
+
+// fill the 64 byte HSPI buffer straight from the registers and let the hardware clock it out
+inline void IRAM_ATTR halShiftOutIsr(const uint8_t* frame, int len) {
+  for (int sent = 0; sent < len; ) {
+    int chunk = (len - sent > 64) ? 64 : len - sent;
+    while (SPI1CMD & SPIBUSY) {}
+    volatile uint32_t* fifo = &SPI1W0;
+    for (int i = 0; i < chunk; i += 4) {
+      uint32_t word = 0;                                // the first byte out is the lowest of W0
+      for (int b = 0; b < 4 && i + b < chunk; b++) word |= (uint32_t)frame[len - 1 - sent - i - b] << (b * 8);
+      fifo[i / 4] = word;
+    }
+    uint32_t bits = chunk * 8 - 1;
+    SPI1U1 = (SPI1U1 & ~((SPIMMOSI << SPILMOSI) | (SPIMMISO << SPILMISO))) | (bits << SPILMOSI) | (bits << SPILMISO);
+    SPI1CMD |= SPIBUSY;
+    sent += chunk;
+  }
+  halLatchPending = true;
+}
+
+inline void IRAM_ATTR halLatchIsr() {
+  if (!halLatchPending || (SPI1CMD & SPIBUSY)) return;  // nothing sent, or still shifting
+  digitalWrite(latchPin, LOW);
+  digitalWrite(latchPin, HIGH);
+  halLatchPending = false;
+}
+
+#else
+inline void halInitPins() {
+  pinMode(LED_BUILTIN, OUTPUT);
+  pinMode(dataPin, OUTPUT);
+  pinMode(clockPin, OUTPUT);
+  pinMode(latchPin, OUTPUT);
+}
+
+inline void halShiftOut(const uint8_t* frame, int len) {
+  digitalWrite(latchPin, LOW);
+  for (int r = len - 1; r >= 0; r--) shiftOut(dataPin, clockPin, MSBFIRST, frame[r]);
+  digitalWrite(latchPin, HIGH);
+}
+
+// bit banged with IRAM safe calls only, latched right away
+inline void IRAM_ATTR halShiftOutIsr(const uint8_t* frame, int len) {
+  digitalWrite(latchPin, LOW);
+  for (int r = len - 1; r >= 0; r--) {
+    for (int b = 7; b >= 0; b--) {                      // MSB first
+      digitalWrite(dataPin, (frame[r] >> b) & 1);
+      digitalWrite(clockPin, HIGH);
+      digitalWrite(clockPin, LOW);
+    }
+  }
+  digitalWrite(latchPin, HIGH);
+}
+
+inline void IRAM_ATTR halLatchIsr() {
+}
+#endif
+
+// call isr from hardware timer1 after ticks of halTimerHz, the isr sets every next interval
+inline void halStartRefreshTimer(void (*isr)(), uint32_t ticks) {
+  timer1_attachInterrupt(isr);
+  timer1_enable(TIM_DIV16, TIM_EDGE, TIM_SINGLE);
+  timer1_write(ticks);
+}
+
+inline void IRAM_ATTR halNextRefresh(uint32_t ticks) {   // one shot, counted from now
+  timer1_write(ticks);
+}
+
+inline void halBuiltinLed(boolean on) {   // the built-in LED is active low
+  digitalWrite(LED_BUILTIN, on ? LOW : HIGH);
+}
+
+// ===================================== MQTT ==================================== //
+inline boolean halPublish(const char* topic, const char* payload) {
+  return client.publish(topic, payload);
+}
+
+inline boolean halPublishBinary(const char* topic, const uint8_t* payload, unsigned int length) {
+  return client.publish(topic, payload, length);
+}
+
+inline boolean halSubscribe(const char* topic) {
+  return client.subscribe(topic);
+}
+
+inline boolean halMqttConnected() {
+  return client.connected();
+}
+
+inline boolean halMqttPoll() {            // let the client process incoming messages
+  return client.loop();
+}
+
+#endif  // HOST_BUILD
+
+#endif
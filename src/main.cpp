@@ -2,7 +2,7 @@
   CHK version 2024-12-14
 
   This sketch is for a MQTT signal server to be used with JMRI or other layout control.
-  An ESP8266 with one or more SN74HC59N shift registers will drive the signal LEDs
+  An ESP8266 with one or more SN74HC595N shift registers will drive the signal LEDs
   It's setup to use bi-polar Green/Red LEDs.
   For these bi-polar LEDs in series with a resistor are connected to 2 pins of the shift register.
   Therefore only 4 LEDs per shift register.
@@ -19,6 +19,35 @@
   2024-12-23 Reworking the dimming logic
              Adding server command to display the light head names:
              -t JMRI/signal/< myHostname > -m heads
+  2026-10-16 Hardware access moved behind a thin HAL (hal.h)
+             Publishing MQTT messages handled per second next to the loop stats
+             Head state kept as compact enums instead of Strings
+             Any number of daisy chained shift registers, head table as parallel arrays
+             Bit sliced frame renderer, 16 heads per 32 bit word
+             LEDs refreshed from a timer interrupt, loop() only renders the sub frames
+             Hardware SPI output, unchanged sub frames are not shifted out again
+             Topics parsed once into tokens, heads found through a hash index
+             No heap allocations on the message path, fixed buffers instead of Strings
+             Head state published from loop() in coalesced batches, optional snapshot topic
+             Subscribing to the topics of our own heads only, counting dropped messages
+             Time based fades with 256 brightness levels, binary code modulated, per bulb type curves
+             Loop duration histogram and time per section, server command stats
+             Optional capture of received messages and rendered frames for replay
+             Batch topic to set the heads of a route in one message
+               -t JMRI/signal/< myHostname >/batch -m <head>=<aspect>;<head>=<aspect>...
+             WiFi and MQTT connected from a state machine with backoff, boot and loop() never wait for the network
+             Trace log of binary event records instead of Serial debug prints, decoder in tools/
+               -t JMRI/signal/< myHostname > -m trace | trace head <head>|all|none | trace serial on|off
+             Commands wait in a slot per head, loop() applies the net change of a burst once per pass
+             Server command bench times the hot paths on the board and compares with the previous run
+             Heap, fragmentation, low water marks, stack and static RAM published with the stats
+             Idle mode: no fades, flashing or commands means no head work or rendering, optional light sleep
+             Head state kept in RTC memory and flash, shown again right after a reset before WiFi starts
+             Flash phase follows the NTP clock, so the heads of all servers flash in step
+             loop() runs a table of tasks with their own period, deadline and priority, misses in the stats
+             Heads keep fading and flashing during an OTA update, gzip images, throughput and stall published
+             Head table, flash time, yellow mix and topic prefix from a binary image in LittleFS, compiler in tools/
+               -t JMRI/signal/< myHostname > -m reload
 */
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
@@ -26,14 +55,20 @@
 #include <WiFiClient.h>
 #include <WiFiUdp.h>
 #include <ArduinoOTA.h>
+#include <LittleFS.h>
 #include <PubSubClient.h>
 #include <time.h>
+#include <limits.h>
+#include <stdarg.h>
 #include "SSID_access.h"
+#include "hal.h"
+#include "trace.h"
+#include "config.h"
 
 
 // ============================== GeneralDefinitions ============================ //
 const char* myHostname ="HOsrv01";  // device identifier
-const char* version = "241223";     // version is by date
+const char* version = "261016";     // version is by date
 #define DOnotDEBUG
 #if defined DODEBUG
 const boolean DEBUG = true;        // debugging variable
@@ -47,101 +82,298 @@ const char* password = SSID_PSW;    // password pulled from "SSID_access.h"
 // int blinkCnt = 0;
 // int blinkDelay = 100;
 // long bluePublish = 0;
-long now = millis();
+long now = halMillis();
+inline long msSince(long t){        // ms from t to now, negative before t, right across the 32 bit millis() wrap
+  return (int32_t)((uint32_t)now - (uint32_t)t);
+}
 // long blinkTime = millis();
 // String State = "on";
 long cycleCnt = 0;                  // Statistics variable to check performance
 const int cyclePeriod = 10000;      // count per 10 sec
-long cycleStart = millis();
+long cycleStart = halMillis();
 float cycleStats = 0;               // track the total of the cycleCounts per publish time
+long msgCnt = 0;                    // Statistics variable, MQTT messages handled in this publish period
+long msgDropped = 0;                // Statistics variable, MQTT messages that were not for us in this publish period
+
+// Timing statistics, in CPU cycles from halCycles(): reading the counter is one instruction,
+// so a section costs a subtraction and a few adds. Reported and reset by the stats server command.
+enum section_t : uint8_t {          // the parts of the work we time
+  SECTION_OTA = 0,                  // ArduinoOTA.handle()
+  SECTION_MQTT,                     // client.loop(), includes the callbacks
+  SECTION_RECONNECT,                // reconnect() attempts
+  SECTION_CALLBACK,                 // callback() for incoming messages
+  SECTION_HEADS,                    // updateHeads() and renderFrames()
+  SECTION_SHIFT,                    // shifting out sub frames in the refresh ISR
+  numSections
+};
+const char* sectionNames[] = {"ota", "mqtt", "reconnect", "callback", "heads", "shift"};
+struct sectionStats {
+  uint64_t cycles;                  // total time spent in the section
+  uint32_t calls;
+  uint32_t maxCycles;               // the longest single call
+};
+sectionStats sections[numSections];
+#define loopBuckets 32              // bucket n counts loops of 2^(n-1) up to 2^n cycles, the last one all longer loops
+uint32_t loopHist[loopBuckets];     // histogram of the time between loop() starts
+uint32_t loopMaxCycles = 0;         // the longest loop
+uint32_t lastLoopStart = 0;         // cycle count at the start of the previous loop, 0 before the first
+unsigned long statsSince = 0;       // millis() of the last reset of the timing statistics
+uint32_t heapLow = UINT32_MAX;      // lowest free heap seen since boot
+uint32_t blockLow = UINT32_MAX;     // smallest largest free block seen since boot
+long nextBlockSample = 0;           // finding the largest block walks the heap, once a second will do
+#define ramBudget 24576             // static RAM the head table and buffers may take, the rest is for WiFi, MQTT and the heap
+
+enum aspect_t : uint8_t {           // the aspects a head can show, 2 bits each
+  ASPECT_DARK = 0,
+  ASPECT_GREEN,
+  ASPECT_RED,
+  ASPECT_YELLOW
+};
+const char* aspectNames[] = {"DARK", "GREEN", "RED", "YELLOW"};  // MQTT text form of aspect_t
 
-struct signal {                     // the structure of the signalHead variables
-  String name;                      // username of the signal head
-  String aspect;                    // aspect the light is to show
-  String currentAspect;             // what are we showing that need dimming
-  String targetAspect;              // what aspect do we change to
-  String flashingAspect;            // save the aspect when flashing
-  int pin;                          // state of the pins used
-  boolean flash;                    // does the head need to flash
-  uint8_t dimPattern;                   // contains the brightness pattern
-  int dimIndex;                     // tracks the bit showing LED on ir off
-  int dimStep;                      // time of next dim step
+enum bulb_t : uint8_t {             // the bulbs a head can imitate, each with its own fade curves
+  BULB_MINIATURE = 0,               // miniature incandescent bulb, the default
+  BULB_GRAIN_OF_WHEAT,              // small and fast
+  BULB_LED                          // modern LED signal, near instant
 };
-#if defined(DODEBUG)
-long dimStepTime = 99;              // time interval between dimming steps. 1/8 of the time to fully dim, 1/16 of the time to switch light colour.
-#else
-long dimStepTime = 44;              // time interval between dimming steps. 1/8 of the time to fully dim, 1/16 of the time to switch light colour.
+
+// ============================= incandescent fades ============================== //
+// A fade follows the filament temperature: it warms up and cools down exponentially, the
+// light it gives grows with a power of the temperature. The curves are sampled in fadeSteps
+// points and computed by the compiler, a fade step is only a table lookup.
+#define fadeSteps 32                // points per fade curve
+#define fadeCooling 0x80            // flag in Heads.fadeStep: the head is cooling down
+
+struct fadeCurve {
+  uint8_t level[fadeSteps];         // brightness 0-255 at every point of the fade
+  uint16_t stepTime;                // ms between the points
+};
+struct bulbCurves {
+  fadeCurve warm;                   // from dark to full brightness
+  fadeCurve cool;                   // from full brightness to dark
+};
+
+// C++11 constexpr functions are a single return statement, as the ESP8266 core 2.x builds them,
+// so the loops are written as recursion and the points of a curve as a parameter pack.
+constexpr float expSum(float x, int n, float term, float sum){ // the series of e^x from term n on
+  return (n == 24) ? sum : expSum(x, n + 1, term * (x / n), sum + term * (x / n));
+}
+
+constexpr float expOf(float x){     // e^x for the small x we need, the compiler has no constexpr exp()
+  return expSum(x, 1, 1, 1);
+}
+
+constexpr float powerOf(float x, int power){
+  return (power == 0) ? 1 : powerOf(x, power - 1) * x;
+}
+
+constexpr float heatAt(int i, bool warm){       // filament temperature 0-1, three time constants per fade
+  return (warm ? 1 - 1 / expOf(3.0f * i / (fadeSteps - 1)) : 1 / expOf(3.0f * i / (fadeSteps - 1)) - 1 / expOf(3))
+         / (1 - 1 / expOf(3));
+}
+
+constexpr uint8_t fadeLevel(int i, int power, bool warm){
+  return (uint8_t)(powerOf(heatAt(i, warm), power) * 255 + 0.5f);
+}
+
+template <int... points> struct fadePoints {};                 // 0 .. fadeSteps-1
+template <int n, int... points> struct fadePointsTo : fadePointsTo<n - 1, n - 1, points...> {};
+template <int... points> struct fadePointsTo<0, points...> { typedef fadePoints<points...> type; };
+
+template <int... points>
+constexpr fadeCurve makeFade(uint16_t fadeTime, int power, bool warm, fadePoints<points...>){
+  return {{fadeLevel(points, power, warm)...}, (uint16_t)(fadeTime / (fadeSteps - 1))};
+}
+
+constexpr fadeCurve makeFade(uint16_t fadeTime, int power, bool warm){
+  return makeFade(fadeTime, power, warm, fadePointsTo<fadeSteps>::type());
+}
+
+constexpr bulbCurves bulbTypes[] = {            // indexed by bulb_t: warm up ms, cool down ms
+  {makeFade(250, 3, true), makeFade(400, 3, false)},   // BULB_MINIATURE
+  {makeFade(120, 3, true), makeFade(200, 3, false)},   // BULB_GRAIN_OF_WHEAT
+  {makeFade(40, 1, true), makeFade(40, 1, false)}      // BULB_LED
+};
+
+#ifndef numShiftRegisters
+#define numShiftRegisters 1         // number of daisy chained shift registers
 #endif
-#define numSignalHeads 4            // four heads per shift register
-struct signal SignalHead[numSignalHeads]={
-  {.name="AMW-A", .aspect="RED", .currentAspect="DARK",  .targetAspect="RED", .pin=0, .flash=false, .dimPattern=255, .dimIndex=0, .dimStep=0},
-  {.name="AMW-B", .aspect="RED", .currentAspect="DARK",  .targetAspect="RED", .pin=2, .flash=false, .dimPattern=255, .dimIndex=0, .dimStep=0},
-  {.name="AMW-C", .aspect="RED", .currentAspect="DARK",  .targetAspect="RED", .pin=4, .flash=false, .dimPattern=255, .dimIndex=0, .dimStep=0},
-  {.name="AMW-D", .aspect="RED", .currentAspect="DARK",  .targetAspect="RED", .pin=6, .flash=false, .dimPattern=255, .dimIndex=0, .dimStep=0}
-};                                  // initialization of the signal heads
-uint8_t signalPins = B10101010;     // this is the variable to push the pin values into the shift register
+#define headsPerRegister 4          // four heads per shift register
+#define numSignalHeads (numShiftRegisters * headsPerRegister)
+
+#define numHeadWords ((numSignalHeads + 15) / 16)  // 16 heads of 2 bits in a 32 bit word
+#define notRENDER_PER_HEAD          // rename to RENDER_PER_HEAD for the per-head reference renderer
+
+// The head state is kept bit sliced: every plane word holds one 2 bit field per head,
+// laid out exactly like the frame (head n at bit (n%16)*2 of word n/16).
+// Aspects are stored as their aspect_t value, flags and brightness bits as B00 or B11.
+// This lets updateHeads() and renderFrames() handle 16 heads at a time with plain 32 bit logic.
+struct headTable {                  // the signalHead variables, indexed by head number or plane word
+  const char* name[numSignalHeads];         // username of the signal head, NULL for an unused output
+  bulb_t bulb[numSignalHeads];              // the bulb we imitate
+  long dimStep[numSignalHeads];             // time of next dim step
+  uint8_t fadeStep[numSignalHeads];         // point on the fade curve, with fadeCooling when cooling down
+  uint32_t aspect[numHeadWords];            // aspect the light is to show
+  uint32_t currentAspect[numHeadWords];     // the colour that is lit, DARK when fully dark
+  uint32_t targetAspect[numHeadWords];      // what aspect do we change to
+  uint32_t flash[numHeadWords];             // does the head need to flash
+  uint32_t pin[numHeadWords];               // state of the pins used
+  uint32_t dimPattern[8][numHeadWords];     // brightness level 0-255, one plane per bit
+  uint32_t dimmed[numHeadWords];            // the level is below 255
+  uint32_t pending[numHeadWords];           // B11 when a command waits in the slot of the head
+  uint32_t pendingAspect[numHeadWords];     // the aspect of the waiting command
+  uint32_t pendingFlash[numHeadWords];      // and its flashing
+  uint32_t pendingBatch[numHeadWords];      // B11 when it came in a batch, /batch/state answered it already
+};
+struct headTable Heads;              // the names and bulbs from below or /config.bin, the rest set by initHeads()
+
+// The heads compiled in: head n sits on register n/4, pins (n%4)*2 and (n%4)*2+1.
+// Outputs past the end of the list have no name and stay dark.
+const char* headNames[numSignalHeads] = {"AMW-A", "AMW-B", "AMW-C", "AMW-D"};
+const bulb_t headBulbs[numSignalHeads] = {};  // BULB_MINIATURE unless set here
+
+// The LEDs are refreshed by a timer interrupt with binary code modulation: a PWM cycle is
+// 8 sub frames, sub frame n shows bit n of the brightness levels and lasts 2^n LSB times.
+// So 8 interrupts per cycle give 256 levels. loop() renders all 8 into the back buffer and
+// hands it over, the ISR picks it up at the start of its next cycle. So the PWM and yellow
+// timing do not depend on the network.
+// The next frame is shifted out while the current one shows, so the LSB time cannot be shorter
+// than a shift out and the ISR: bcmLsbTicks is the larger of halTimerHz / (bcmCycleRate * 255),
+// 78 ticks, and halShiftTicks(8 * registers) + refreshIsrTicks. A cycle is 255 LSB times. At a
+// 4 MHz spiClock a register shifts out in 10 ticks, so up to 5 registers keep 250 Hz, 6 give
+// 85 ticks and 231 Hz, 32 give 345 ticks and 57 Hz, unless spiClock goes up. Bit banged, a
+// register takes 64 ticks and even one lowers the rate, to 220 Hz.
+#define bcmCycleRate 250            // PWM cycles per second
+#define subFrames 8                 // sub frames per PWM cycle, one per brightness bit
+#define refreshIsrTicks 25          // timer ticks the ISR itself takes, about 5 us
+constexpr uint32_t bcmLsbFor(uint32_t cycleTicks, uint32_t shiftTicks){  // the LSB must outlast a shift out
+  return (cycleTicks > shiftTicks) ? cycleTicks : shiftTicks;
+}
+const uint32_t bcmLsbTicks = bcmLsbFor(halTimerHz / (bcmCycleRate * 255),
+                                       halShiftTicks(numShiftRegisters * 8) + refreshIsrTicks);
+uint8_t frameBuffer[2][subFrames][numShiftRegisters]; // byte n of a sub frame goes to register n
+volatile uint8_t readyBuffer = 0;   // the newest rendered buffer
+volatile uint8_t frontBuffer = 0;   // the buffer the ISR is showing
+volatile uint8_t refreshPhase = 0;  // the sub frame the ISR shows next
+volatile unsigned long refreshTicks = 0; // Statistics variable, refresh interrupts
+volatile unsigned long framesWritten = 0; // Statistics variable, sub frames shifted out
+volatile unsigned long framesSkipped = 0; // Statistics variable, sub frames equal to what the registers hold
+uint8_t lastFrame[numShiftRegisters];     // what the registers hold, only the ISR touches it
 #if defined(DODEBUG)
-  const int flashTime = 10000;      // flash time is set to 10 sec.
+  int flashTime = 10000;            // flash time is set to 10 sec.
 #else
-  const int flashTime = 1000;       // flash time is set to 1 sec.
+  int flashTime = 1000;             // flash time is set to 1 sec.
 #endif
-long lastFlashTime = 0;             // variable to keep track of the flash time
 boolean flashOn = true;             // variable of the flash state.
-byte mask = 0;                      // variable to mask pins
-byte myPins = 3;                    // variable to set the pins of the head.
-byte outherPins = B00111111;        // mask to retain other pin values.
-uint8_t yellowCycle = B11101110;    // this is the pattern for the mix of green and red to make amber/yellow
-boolean setGreen = true;            // are we to show green or red?
+boolean flashSynced = false;        // the flash phase follows the NTP clock, not millis() yet
+uint8_t yellowCycle = B11000000;    // sub frames that show green for yellow: 192 of 255 LSB times green, the rest red
 int internalCycle = 0;              // create a dimming cycle for the internal LED
+boolean ledLit = false;             // the internal LED is on
+
+// With no head fading or flashing and no command waiting, the frames the ISR shows stay right,
+// so loop() skips the head work and the rendering and gives the time to the WiFi stack.
+boolean headsIdle = false;          // no head fading or flashing after the last updateHeads()
+boolean framesDirty = true;         // head state changed since the frames were rendered
+boolean framesConstant = false;     // all sub frames of the shown frames are equal, the registers hold them
+unsigned long idleLoops = 0;        // Statistics variable, passes without head work
+#define idleDelay 2                 // ms an idle pass waits for the network
+#define notIDLE_SLEEP               // rename to IDLE_SLEEP to let WiFi light sleep while idle with constant frames
+#if defined(IDLE_SLEEP)
+boolean sleeping = false;
+#endif
 const int dimBlue = 96;             // dim limit count down, cannot use the same as for the other LEDs
 
-// =============================== Pin Definitions =============================== //
-int dataPin = D6;                   // pin D6 on NodeMCU boards for data bits
-int latchPin = D7;                  // pin D7 on NodeMCU boards for latching
-int clockPin = D8;                  // pin D8 on NodeMCU boards for clock pulse
-
 // ========================= function declarations =============================== //
 
 void callback(char* topic, byte* payload, unsigned int length);
+void IRAM_ATTR sectionEnd(section_t section, uint32_t start);
+void loopTime(uint32_t cycles);
 boolean reconnect();
+void manageConnection();
+void subscribeTopics();
 WiFiClient espClient;
 String utcTime();
 void showTime();
-boolean isGreen(uint8_t *yellowCycle);
-void printBinary(byte inByte);
 void publishAspect(int s);
-void publishFlashing(int s);
-void publishDebug(String message);
-String trueAspect(signal signalHead);
-void serverCommands(String topicStr, String pl);
+void markDirty(int s);
+void publishDirtyHeads();
+void trace(trace_t event, int s, uint8_t from, uint8_t arg);
+uint8_t headState(int s);
+void traceDrain();
+void traceCommand(const char* arg, unsigned int length);
+void publishStats();
+void publishMemory();
+void sampleHeap();
+void handleMessage(char* topic, byte* payload, unsigned int length);
+void setAspect(int s, aspect_t aspect, boolean flash);
+void batchCommand(const byte* payload, unsigned int length);
+boolean appendReply(size_t &used, const char* format, ...);
+void publishTiming();
+void resetTiming();
+void benchCommand();
+#if defined(CAPTURE)
+void captureMessage(const char* topic, const byte* payload, unsigned int length);
+void captureFrames(uint8_t frames[subFrames][numShiftRegisters]);
+void captureCommand(const char* arg, unsigned int length);
+void captureHeads();
+#endif
+const char* trueAspect(int s);
+void initHeads();
+void updateHeads();
+void applyCommands();
+void idleWait();
+boolean flashPhase();
+boolean restoreSnapshot();
+void saveSnapshot();
+void publishBoot();
+boolean loadConfig();
+void reloadConfig();
+void onOTAStart();
+void onOTAProgress(unsigned int progress, unsigned int total);
+void onOTAEnd();
+void onOTAError(ota_error_t error);
+void saveOta();
+void publishOta();
+void initTasks();
+void runTasks();
+boolean runTask(int t);
+void taskSignal(int t);
+void headsTask();
+void otaTask();
+void ledTask();
+void statsTask();
+void renderFrames(uint8_t frames[subFrames][numShiftRegisters]);
+void IRAM_ATTR refreshIsr();
+uint8_t getHead(const uint32_t* plane, int s);
+void setHead(uint32_t* plane, int s, uint8_t value);
+void setHeadFlag(uint32_t* plane, int s, boolean on);
+void serverCommands(const byte* payload, unsigned int length);
+void buildHeadIndex();
+int findHead(const char* name, int len);
 
 // ===================================== OTA ==================================== //
-//
-long ota_progress_millis = 0;
-
-void onOTAStart() {
-  // Log when OTA has started
-  Serial.println("OTA update started!");
-  // <Add your own code here>
-}
-
-void onOTAProgress(size_t current, size_t final) {
-  // Log every 1 second
-  if (millis() - ota_progress_millis > 1000) {
-    ota_progress_millis = millis();
-    Serial.printf("OTA Progress Current: %u bytes, Final: %u bytes\n", current, final);
-  }
-}
-
-void onOTAEnd(bool success) {
-  // Log when OTA has finished
-  if (success) {
-    Serial.println("OTA update finished successfully!");
-  } else {
-    Serial.println("There was an error during OTA update!");
-  }
-  // <Add your own code here>
-}
+// ArduinoOTA receives the whole image within one ArduinoOTA.handle() call. The refresh interrupt
+// keeps the LEDs lit meanwhile, but without loop() the heads would not fade or flash, so every
+// received chunk gives the heads task its turn. The Updater writes flash a 4 KB sector at a time,
+// one sector write is the longest the heads wait.
+// A gzip compressed image (gzip -9 firmware.bin) is taken as well: it is stored as it is and the
+// boot loader inflates it while copying it over the old sketch, so it needs no RAM here. The
+// report has the bytes received, compressed ones for such an image.
+#define otaRtcOffset 112            // RTC user memory block of the last update, above the bench run
+#define otaPrintTime 1000           // ms between progress lines on Serial, at 9600 baud they take time
+const uint32_t otaMagic = 0x07A00000;
+struct otaReport {
+  uint32_t magic;                   // otaMagic, cleared once published
+  uint32_t bytes;                   // received, compressed for a gzip image
+  uint32_t ms;                      // from the start to the end of the transfer
+  uint32_t maxStall;                // ms of the longest wait of the heads
+  uint32_t error;                   // ota_error_t, or otaNoError
+};
+const uint32_t otaNoError = 0xFF;
+otaReport ota;                      // the update in progress
+unsigned long otaStart = 0;
+unsigned long otaLastChunk = 0;     // ms of the last chunk received
+unsigned long otaLastPrint = 0;
 
 // ===================================== NTP ==================================== //
 // IPAddress timeServerIP = "192.168.0.60";
@@ -154,14 +386,165 @@ tm tm;                              // the structure tm holds time information i
 // ============================== MQTT Definitions =============================== //
 #define mqtt_server "mqtt.klomp.ca" // your MQTT server
 #define mqtt_port 41883
-// reconnect every 5 seconds
-long lastReconnectAttempt = 0;
-long nextPublish = 0;               // variale to keep track of the last publish message
+
+// Connection state machine, loop() only ever makes one short attempt and moves on.
+// Failed attempts back off exponentially with jitter, so a dead broker or access point
+// costs the loop a stalled attempt every minute at most and the servers do not retry in step.
+enum net_t : uint8_t {
+  NET_WIFI_DOWN = 0,                // waiting for the access point
+  NET_MQTT_DOWN,                    // WiFi up, broker not connected
+  NET_UP                            // connected to the broker
+};
+const char* netNames[] = {"wifi down", "mqtt down", "up"};
+net_t netState = NET_WIFI_DOWN;
+#define backoffMin 1000             // ms before the first retry
+#define backoffMax 60000            // ms between retries at most
+#define wifiRetryTime 30000         // ms to leave the WiFi stack reconnecting on its own before a new begin()
+#define dnsTimeout 500              // ms to wait for the broker address
+#define connectTimeout 500          // ms to wait for the TCP connection to the broker
+#define brokerTimeout 1             // s to wait for the broker's replies
+long backoff = backoffMin;          // wait after the next failed attempt
+long nextAttempt = 0;               // time of the next attempt
+boolean otaStarted = false;         // ArduinoOTA is started once we have an address
+boolean brokerResolved = false;     // broker address looked up for this WiFi connection
+IPAddress brokerIP;
+long netLost = 0;                   // times the connection to the broker was lost
 #define publish_delay 600000        // 10 min between publishings
 char* topicPrefix = (char*) "JMRI/signal/"; // topic prefix for MQTT communication
-String message ="";
+#define maxTopicLength 128          // longest topic we publish on
+char pubTopic[maxTopicLength];      // scratch buffer for the topics we publish or subscribe on
+#define notSUBSCRIBE_ALL            // rename to SUBSCRIBE_ALL to receive everything under topicPrefix again
+char message[128];                  // scratch buffer for debug messages
+
+// The batch state and the head list grow with the heads and their names, the stats and bench
+// lists do not. The MQTT client buffer holds the longest of them or a batch with its topic,
+// PubSubClient drops larger packets it receives and refuses larger publishes.
+#define batchTextSize (configArenaSizeFor(numSignalHeads) + numSignalHeads * 16)  // names and =FLASHINGYELLOW;
+#define statsTextSize 512
+#define replySize ((batchTextSize > statsTextSize) ? batchTextSize : statsTextSize)
+#define mqttBufferSize (MQTT_MAX_HEADER_SIZE + 2 + maxTopicLength + replySize)
+char reply[replySize];              // scratch buffer for the replies that list heads, tasks or benches
+
+// Head changes only mark the head dirty, loop() publishes the dirty heads in batches.
+// All changes of a head within one window collapse into one publish of its latest state.
+#define publishWindow 20            // ms between flushes of the dirty heads
+#define publishBudget 4             // dirty heads published per flush, 5 messages each
+#define notPUBLISH_SNAPSHOT         // rename to PUBLISH_SNAPSHOT for all heads in one <myHostname>/snapshot message
+
+// Session capture: with CAPTURE defined the server can record what it receives and what it
+// renders, to replay a real JMRI session against a build and compare the frames.
+// Records, little endian, packed one after the other:
+//   uint32 millis, uint8 0, uint16 shift registers, uint8 sub frames                   first, the chain
+//   uint32 millis, uint8 3, uint16 output, uint8 name length, name                     then every named head
+//   uint32 millis, uint8 1, uint8 topic length, uint8 payload length, topic, payload   a received message
+//   uint32 millis, uint8 2, sub frames x shift registers bytes                         rendered frames that changed
+// host/replay.cpp plays a dump back into a host build and compares the frames.
+#define notCAPTURE                  // rename to CAPTURE to build in the capture server commands
+#if defined(CAPTURE)
+#define captureSize 8192            // bytes of RAM for the records
+#define captureChunk 192            // bytes per <myHostname>/capture message when dumping
+uint8_t captureBuf[captureSize];
+size_t captureUsed = 0;
+boolean capturing = false;
+boolean captureFull = false;        // records were lost, the buffer ran full
+boolean captureFramesKnown = false; // the last rendered frames are recorded
+#endif
+
+// Trace log: events are written into a ring of fixed records, a few stores each, so it stays on
+// in production and debug builds run like the real thing. loop() sends them over Serial only as
+// far as the UART has room, the trace command publishes the last traceSize records.
+// The record format is in trace.h, tools/tracedecode.cpp turns both into text.
+#define traceSize 256               // records kept, a power of 2, 12 bytes each
+#define traceChunk 14               // records per <myHostname>/trace message
+#define traceAllHeads numSignalHeads  // traceStepHead value for the fade steps of every head
+traceRecord traceBuf[traceSize];
+uint32_t traceWritten = 0;          // records written since boot, the newest is at (traceWritten - 1) % traceSize
+uint32_t traceSent = 0;             // records sent over Serial
+boolean traceSerial = DEBUG;        // send the records over Serial, the debug build does by default
+int traceStepHead = -1;             // head whose fade steps are traced, traceAllHeads, -1 for none
+boolean tracePaused = false;        // no records, while bench runs
+
+// Head snapshot: the aspects and flashing of all heads go into RTC memory on every change, that
+// survives a restart, a watchdog reset or an OTA update, and into a file in flash at most once
+// a minute for a power cycle. LittleFS spreads the writes over the flash. setup() shows the
+// snapshot before WiFi starts, so a reset does not put wrong aspects on the layout.
+#define snapshotRtcOffset 32        // RTC user memory block, after the OTA boot command and below the bench run
+#define snapshotFile "/heads.bin"
+#define snapshotFlashTime 60000     // ms between flash writes at least
+struct headSnapshot {
+  uint32_t magic;                   // snapshotMagic
+  uint32_t crc;                     // CRC-32 of what follows
+  uint32_t aspect[numHeadWords];    // Heads.aspect
+  uint16_t flash[numHeadWords];     // Heads.flash, one bit per head
+};
+const uint32_t snapshotMagic = 0x53480000 | numSignalHeads;  // a snapshot of another head count is no use
+boolean snapshotDirty = false;      // heads changed since the last RTC snapshot
+boolean flashDirty = false;         // the flash copy is behind the RTC copy
+long lastFlashWrite = 0;             // so not before snapshotFlashTime after boot either
+boolean fsMounted = false;
+const char* bootSource = "defaults";  // where the head state came from at boot
+unsigned long bootShown = 0;        // ms after reset the boot aspects showed
+
+// Head configuration: without a valid image in LittleFS the server runs with the heads, flash
+// time, yellow mix and topic prefix compiled in here. See config.h for the image.
+#define configFile "/config.bin"
+char configArena[configArenaSizeFor(numSignalHeads)];  // names and topic prefix of the loaded image
+const char* configSource = "built in";  // where the configuration came from
+unsigned long configLoadTime = 0;   // ms the last load took
+unsigned long fsMountTime = 0;      // ms LittleFS.begin() took at boot
+uint32_t publishDirty[numHeadWords];  // B11 for heads whose state is still to be published, laid out like the head planes
+int publishCursor = 0;              // plane word the next flush starts at, so no head starves
 PubSubClient client(mqtt_server, mqtt_port, callback, espClient);
 
+// ================================ task scheduler =============================== //
+// loop() runs the tasks of this table, the table order is their priority. A task is due once
+// every period, or right away when taskSignal() raised an event for it. It misses its deadline
+// when it starts more than deadline after it was due. The heads run whenever they are due, the
+// housekeeping after them only when its usual run time fits before the heads are due again,
+// or when it has used up half of its deadline waiting.
+enum task_t : uint8_t {
+  TASK_HEADS = 0,                   // commands, fades, flashing and rendering
+  TASK_NET,                         // WiFi and MQTT connection, polls the broker for messages
+  TASK_OTA,                         // ArduinoOTA.handle()
+  TASK_PUBLISH,                     // state of the dirty heads
+  TASK_TRACE,                       // trace records to Serial
+  TASK_LED,                         // built-in LED
+  TASK_SNAPSHOT,                    // head state to RTC memory and flash
+  TASK_HEAP,                        // heap low water marks
+  TASK_STATS,                       // time and performance counters
+  numTasks
+};
+struct taskInfo {
+  const char* name;
+  void (*run)();
+  uint32_t period;                  // us from one due time to the next
+  uint32_t deadline;                // us after the due time the task must have started by
+};
+const taskInfo taskTable[numTasks] = {
+  {"heads",    headsTask,         1000000 / bcmCycleRate,  1000000 / bcmCycleRate},  // new frames for every PWM cycle
+  {"net",      manageConnection,  2000,                    20000},
+  {"ota",      otaTask,           10000,                   100000},
+  {"publish",  publishDirtyHeads, publishWindow * 1000UL,  100000},
+  {"trace",    traceDrain,        10000,                   100000},
+  {"led",      ledTask,           1000,                    100000},
+  {"snapshot", saveSnapshot,      100000,                  1000000},
+  {"heap",     sampleHeap,        10000,                   1000000},
+  {"stats",    statsTask,         publish_delay * 1000UL,  10000000},
+};
+struct taskState {
+  uint32_t due;                     // halMicros() the task is due next
+  uint32_t cost;                    // us a run usually takes, smoothed over the last runs
+  boolean signalled;                // an event is waiting for the task
+};
+taskState tasks[numTasks];
+struct taskStats {                  // reported and reset with the timing statistics
+  uint32_t runs;
+  uint32_t misses;                  // runs started after their deadline
+  uint32_t maxLate;                 // us the latest start came after the due time
+  uint32_t maxRun;                  // us the longest run took
+};
+taskStats taskCounts[numTasks];
+
 
 // =============================================================================== //
 //                                Setup procedures                                 //
@@ -176,22 +559,35 @@ void setup() {
   // blinks = 1;
 
   // initialize digital pin LED_BUILTIN as an output.
-  pinMode(LED_BUILTIN, OUTPUT);
-  pinMode(dataPin, OUTPUT);
-  pinMode(clockPin, OUTPUT);
-  pinMode(latchPin, OUTPUT);
-  signalPins = B01010101;
-  digitalWrite(latchPin, LOW);
-  shiftOut(dataPin, clockPin, MSBFIRST, signalPins);
-  digitalWrite(latchPin, HIGH);
+  for (int s=0; s<numSignalHeads; s++){                            // the heads compiled in
+    Heads.name[s] = headNames[s];
+    Heads.bulb[s] = headBulbs[s];
+  }
+  initHeads();
+  halInitPins();
+  boolean restored = restoreSnapshot();                            // from RTC, the file system is not mounted yet
+  renderFrames(frameBuffer[0]);
+  memcpy(frameBuffer[1], frameBuffer[0], sizeof(frameBuffer[0]));
+  halShiftOut(frameBuffer[0][subFrames - 1], numShiftRegisters);   // the longest sub frame, until the ISR runs
+  memcpy(lastFrame, frameBuffer[0][subFrames - 1], numShiftRegisters);
+  halStartRefreshTimer(refreshIsr, bcmLsbTicks);                   // from now on the ISR drives the LEDs
+  bootShown = halMillis();
+
+  // The mount waits until the heads show, it formats an empty flash first. Heads only
+  // /config.bin names, and the flash snapshot after a power cycle, show after it.
+  unsigned long mountStart = halMillis();
+  fsMounted = LittleFS.begin();                                    // for the configuration and the flash snapshot
+  fsMountTime = halMillis() - mountStart;
+  boolean loaded = loadConfig();                                   // the heads of /config.bin replace the compiled ones
+  if (loaded) initHeads();
+  else buildHeadIndex();
+  if ((loaded || !restored) && restoreSnapshot() && !restored) bootShown = halMillis();  // shown by the first loop()
 
   WiFi.mode(WIFI_STA);
-  WiFi.begin(MY_SSID, SSID_PSW);
-  while (WiFi.waitForConnectResult() != WL_CONNECTED) {
-    Serial.println("Connection Failed! Rebooting...");
-    delay(5000);
-    ESP.restart();
-  }
+  WiFi.setAutoReconnect(true);
+  WiFi.begin(MY_SSID, SSID_PSW);                                   // connects in the background, see manageConnection()
+  nextAttempt = halMillis() + wifiRetryTime;
+  randomSeed(ESP.getChipId() ^ halCycles());                       // jitter differs between servers
 
   // Port defaults to 8266
   ArduinoOTA.setPort(8266);
@@ -203,36 +599,23 @@ void setup() {
   //ArduinoOTA.setPassword((const char *)"PwrSw01.OTA");
   ArduinoOTA.setPassword((const char *)OTA_PSW);
 
-  ArduinoOTA.onStart([]() {
-    Serial.println("Start OTA loading...");
-  });
-  ArduinoOTA.onEnd([]() {
-    Serial.println("\nEnd OTA loading.");
-  });
-  ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
-    Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
-  });
-  ArduinoOTA.onError([](ota_error_t error) {
-    Serial.printf("Error[%u]: ", error);
-    if (error == OTA_AUTH_ERROR) Serial.println("Auth Failed");
-    else if (error == OTA_BEGIN_ERROR) Serial.println("Begin Failed");
-    else if (error == OTA_CONNECT_ERROR) Serial.println("Connect Failed");
-    else if (error == OTA_RECEIVE_ERROR) Serial.println("Receive Failed");
-    else if (error == OTA_END_ERROR) Serial.println("End Failed");
-  });
-  ArduinoOTA.begin();
-  
-  Serial.println("Ready");
-  Serial.print("IP address: ");
-  Serial.println(WiFi.localIP());
+  ArduinoOTA.onStart(onOTAStart);
+  ArduinoOTA.onEnd(onOTAEnd);
+  ArduinoOTA.onProgress(onOTAProgress);
+  ArduinoOTA.onError(onOTAError);
+  // ArduinoOTA.begin() follows once WiFi is up
 
   // setting up MQTT
   client.setServer(mqtt_server, mqtt_port);
   client.setCallback(callback);
+  client.setSocketTimeout(brokerTimeout);
+  if (!client.setBufferSize(mqttBufferSize)) Serial.println("No memory for the MQTT buffer, batches and lists will be dropped");
+  espClient.setTimeout(connectTimeout);
 
   // Init and get the time
   configTime(MY_TZ, NTP_SERVER);
   showTime();
+  initTasks();
 
 } // end setup
 
@@ -242,7 +625,10 @@ void setup() {
 // =============================================================================== //
 
 void loop() {
-  now = millis();
+  uint32_t loopStart = halCycles();
+  if (lastLoopStart) loopTime(loopStart - lastLoopStart);         // includes the system work between two loops
+  lastLoopStart = loopStart;
+  now = halMillis();
 
   // stats
   cycleCnt++;                                                      // increase count for every loop
@@ -251,236 +637,442 @@ void loop() {
     cycleStats += cycleCnt/(cyclePeriod/1000);                     // how many cycles did we per second
     cycleCnt = 0;
   }
+  runTasks();                                                      // what is due, in the order of the task table
+  idleWait();
+} // end of main loop
+
+
+void initTasks(){                                                  // all tasks due right away
+  uint32_t start = halMicros();
+  for (int t=0; t<numTasks; t++) tasks[t].due = start;
+}
+
+
+void runTasks(){
+  for (int t=0; t<numTasks; t++){
+    uint32_t start = halMicros();
+    if ((t != TASK_HEADS) && ((int32_t)(start - tasks[t].due) < (int32_t)(taskTable[t].deadline / 2))
+        && ((int32_t)(tasks[TASK_HEADS].due - start) < (int32_t)tasks[t].cost)) continue;  // would hold up the heads
+    runTask(t);
+  }
+}
+
+
+boolean runTask(int t){                                            // run task t if it is due or signalled
+  const taskInfo &task = taskTable[t];
+  taskState &state = tasks[t];
+  uint32_t start = halMicros();
+  int32_t late = start - state.due;
+  if ((late < 0) && !state.signalled) return false;
+  state.signalled = false;
+  now = halMillis();
+  task.run();
+  uint32_t run = halMicros() - start;
+  state.cost = (7 * state.cost + run) / 8;
+  taskStats &counts = taskCounts[t];
+  counts.runs++;
+  if (run > counts.maxRun) counts.maxRun = run;
+  if (late < 0) return true;                                       // an event before the due time
+  if (late > (int32_t)task.deadline) counts.misses++;
+  if ((uint32_t)late > counts.maxLate) counts.maxLate = late;
+  state.due += task.period;
+  if ((int32_t)(start - state.due) >= 0) state.due = start + task.period;  // fell behind, no burst to catch up
+  return true;
+}
+
+
+void taskSignal(int t){                                            // run task t in the next pass, due or not
+  tasks[t].signalled = true;
+}
+
+
+void headsTask(){
+  uint32_t sectionStart = halCycles();
+  flashOn = flashPhase();                                          // do we show light or not
+  applyCommands();                                                 // net change of the commands since the last run
+  if (!headsIdle) updateHeads();                                   // flash and dim state of all heads
+  if (framesDirty && (frontBuffer == readyBuffer)){                // the ISR took the last frames, render new ones
+    uint8_t (*frames)[numShiftRegisters] = frameBuffer[1 - readyBuffer];
+    renderFrames(frames);
+    framesConstant = true;
+    for (int f=1; f<subFrames; f++) framesConstant = framesConstant && (memcmp(frames[f], frames[0], numShiftRegisters) == 0);
+    framesDirty = false;
+    readyBuffer = 1 - readyBuffer;
+#if defined(CAPTURE)
+    captureFrames(frameBuffer[readyBuffer]);
+#endif
+  }
+  if (framesDirty) taskSignal(TASK_HEADS);                         // the ISR still shows the last frames, try again next pass
+  sectionEnd(SECTION_HEADS, sectionStart);
+}
+
+
+void otaTask(){
+  uint32_t sectionStart = halCycles();
   ArduinoOTA.handle();
+  sectionEnd(SECTION_OTA, sectionStart);
+}
 
-  // Check MQTT
-  if (!client.connected()) {
-    if ((now - lastReconnectAttempt) > 5000) {
-      lastReconnectAttempt = now;
-      if (reconnect()) {                                           // Attempt to reconnect
-        lastReconnectAttempt = 0;
-      }
-    }
-  } else {
-    client.loop();                                                 // Client connected
+
+void ledTask(){
+  if (!flashOn) return;
+  internalCycle--;
+  boolean lit = internalCycle < 0;
+  if (lit) internalCycle = dimBlue;                                // flash the build-in LED with this rate
+  if (lit != ledLit){
+    ledLit = lit;
+    halBuiltinLed(lit);
   }
+}
+
 
-  // light processing
-  if ((now - lastFlashTime) > flashTime){                         // do we show light or not
-    lastFlashTime = now;
-    flashOn = not flashOn;
+void statsTask(){
+  String payload = "";
+  payload = utcTime();                                             // publish the current time
+  String level = topicPrefix;
+  level += myHostname;
+  level += "/";
+  level += "time";
+  halPublish((char*)level.c_str(), (char*)payload.c_str());
+
+  publishStats();
+}
+
+
+// =============================================================================== //
+//                               MQTT processing                                   //
+// =============================================================================== //
+
+// the payloads we act on, matched once per message
+enum payload_t : uint8_t {
+  PAYLOAD_OTHER = 0,
+  PAYLOAD_ASPECT,                   // one of the aspects, with or without FLASHING
+  PAYLOAD_ON,
+  PAYLOAD_OFF,
+  PAYLOAD_QUERY
+};
+struct payloadWord {
+  const char* text;
+  payload_t type;
+  aspect_t aspect;
+  bool flash;
+};
+const payloadWord payloadWords[] = {           // aspects are case insensitive, the others are not
+  {"ON", PAYLOAD_ON, ASPECT_DARK, false},
+  {"OFF", PAYLOAD_OFF, ASPECT_DARK, false},
+  {"?", PAYLOAD_QUERY, ASPECT_DARK, false},
+  {"GREEN", PAYLOAD_ASPECT, ASPECT_GREEN, false},
+  {"RED", PAYLOAD_ASPECT, ASPECT_RED, false},
+  {"YELLOW", PAYLOAD_ASPECT, ASPECT_YELLOW, false},
+  {"DARK", PAYLOAD_ASPECT, ASPECT_DARK, false},
+  {"FLASHINGGREEN", PAYLOAD_ASPECT, ASPECT_GREEN, true},
+  {"FLASHINGRED", PAYLOAD_ASPECT, ASPECT_RED, true},
+  {"FLASHINGYELLOW", PAYLOAD_ASPECT, ASPECT_YELLOW, true}
+};
+const payloadWord otherPayload = {"", PAYLOAD_OTHER, ASPECT_DARK, false};
+#define numPayloadWords (sizeof(payloadWords) / sizeof(payloadWords[0]))
+
+// the lights of a head in light/set/<head>-<colour> topics
+enum colour_t : uint8_t {
+  COLOUR_NONE = 0,
+  COLOUR_GREEN,
+  COLOUR_RED,
+  COLOUR_YELLOW,
+  COLOUR_FLASHING
+};
+const char* colourNames[] = {"", "green", "red", "yellow", "flashing"};
+const aspect_t colourAspects[] = {ASPECT_DARK, ASPECT_GREEN, ASPECT_RED, ASPECT_YELLOW, ASPECT_DARK};
+
+#define maxTopicTokens 4            // light/set/<head>/<colour> is the deepest topic we handle
+struct topicTokens {                // the levels of a topic after the prefix, not 0 terminated
+  const char* text[maxTopicTokens];
+  uint8_t len[maxTopicTokens];
+  uint8_t count;                    // maxTopicTokens + 1 for deeper topics
+};
+
+boolean tokenIs(const topicTokens &tokens, int t, const char* word){
+  return (tokens.len[t] == strlen(word)) && (strncmp(tokens.text[t], word, tokens.len[t]) == 0);
+}
+
+void splitTopic(const char* topic, topicTokens &tokens){
+  tokens.count = 0;
+  while (tokens.count < maxTopicTokens){
+    const char* end = strchr(topic, '/');
+    size_t len = end ? (size_t)(end - topic) : strlen(topic);
+    tokens.text[tokens.count] = topic;
+    tokens.len[tokens.count] = len > 255 ? 255 : len;
+    tokens.count++;
+    if (end == NULL) return;
+    topic = end + 1;
   }
-  if (flashOn){
-    internalCycle--;
-    if (internalCycle < 0){
-      internalCycle = dimBlue;
-      digitalWrite(LED_BUILTIN, LOW);                             // flash the build-in LED with this rate
-    } else digitalWrite(LED_BUILTIN, HIGH);
+  tokens.count++;                                                 // too deep, not one of ours
+}
+
+const payloadWord &matchPayload(const byte* payload, unsigned int length){
+  for (unsigned int w=0; w<numPayloadWords; w++){
+    const payloadWord &word = payloadWords[w];
+    if (strlen(word.text) != length) continue;
+    if (word.type == PAYLOAD_ASPECT){
+      if (strncasecmp(word.text, (const char*)payload, length) == 0) return word;
+    } else if (strncmp(word.text, (const char*)payload, length) == 0) return word;
   }
+  return otherPayload;
+}
 
-  setGreen = isGreen(&yellowCycle);                               // do we show green or red?
+colour_t matchColour(const char* text, int len){
+  for (int c=COLOUR_GREEN; c<=COLOUR_FLASHING; c++){
+    if (((int)strlen(colourNames[c]) == len) && (strncmp(colourNames[c], text, len) == 0)) return (colour_t)c;
+  }
+  return COLOUR_NONE;
+}
 
-  for(int s=0; s<numSignalHeads; s++){                            // process for every signal head
-    myPins = SignalHead[s].pin << (s*2);                          // get from aspect
-    mask = 3 << (s*2);                                            // get the right mask
-    if (SignalHead[s].currentAspect.indexOf("YELLOW") == 0){      // for Yellow we need to alternate colours
-      if (setGreen) myPins = B10<< (s*2);                         // show green
-      else myPins = B01<< (s*2);                                  // or red
-    } else if (SignalHead[s].currentAspect.indexOf("DARK") == 0){ // for dark
-      myPins = B11 << (s*2);                                      // dark for both pins high
-    }
 
-    if(SignalHead[s].flash) {                                     // do we need to flash?
-      if(flashOn) SignalHead[s].targetAspect = SignalHead[s].aspect;
-      else SignalHead[s].targetAspect = "DARK";
+// a set command for head s, colour is COLOUR_NONE for <head>/set topics
+void headCommand(int s, colour_t colour, const payloadWord &pl){
+  if (colour == COLOUR_FLASHING){
+    // payload OFF only for flashing and only when the aspect is changing
+    if (!getHead(Heads.pending, s)) setHead(Heads.pendingAspect, s, getHead(Heads.aspect, s));
+    setHeadFlag(Heads.pendingFlash, s, pl.type != PAYLOAD_OFF);
+    setHeadFlag(Heads.pending, s, true);
+    setHeadFlag(Heads.pendingBatch, s, false);
+    taskSignal(TASK_HEADS);
+    return;
+  }
+  if (pl.type == PAYLOAD_ASPECT){                                 // did we receive an aspect?
+    setAspect(s, pl.aspect, pl.flash);
+  } else if ((pl.type == PAYLOAD_ON) && (colour != COLOUR_NONE)){ // or a light turned on
+    setAspect(s, colourAspects[colour], false);
+  } else if (pl.type != PAYLOAD_OFF){
+    trace(TRACE_UNKNOWN, s, headState(s), pl.type);
+  }
+}
+
+
+// Commands only fill the slot of their head, the latest wins. applyCommands() takes the slots
+// in loop(), so the callback work is the same whatever the head is doing.
+void setAspect(int s, aspect_t aspect, boolean flash){
+  setHead(Heads.pendingAspect, s, aspect);
+  setHeadFlag(Heads.pendingFlash, s, flash);
+  setHeadFlag(Heads.pending, s, true);
+  setHeadFlag(Heads.pendingBatch, s, false);
+  taskSignal(TASK_HEADS);                       // applied in the next pass, not at the next PWM cycle
+}
+
+
+// <myHostname>/batch: head=ASPECT;head=ASPECT...  All heads change within this one call, so
+// they start fading in the same frame. The answer is one message on <myHostname>/batch/state
+// in the same form with the aspect each head got, or ? for an unknown head or aspect. That is
+// the only publish for those heads, unless another command for them follows before the pass.
+void batchCommand(const byte* payload, unsigned int length){
+  size_t used = 0;
+  const char* entry = (const char*)payload;
+  const char* end = entry + length;
+  while (entry < end){
+    const char* next = (const char*)memchr(entry, ';', end - entry);
+    if (next == NULL) next = end;
+    const char* equals = (const char*)memchr(entry, '=', next - entry);
+    if (equals != NULL){
+      int s = findHead(entry, equals - entry);
+      const payloadWord &pl = matchPayload((const byte*)equals + 1, next - equals - 1);
+      const char* result = "?";
+      if ((s >= 0) && (pl.type == PAYLOAD_ASPECT)){
+        setAspect(s, pl.aspect, pl.flash);
+        setHeadFlag(Heads.pendingBatch, s, true);
+        result = trueAspect(s);
+      }
+      appendReply(used, "%s%.*s=%s", used ? ";" : "", (int)(equals - entry), entry, result);
     }
+    entry = next + 1;
+  }
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/batch/state", topicPrefix, myHostname);
+  halPublish(pubTopic, used ? reply : "");
+}
 
-    if ((SignalHead[s].currentAspect.compareTo(SignalHead[s].aspect) != 0) ||
-        (SignalHead[s].currentAspect.compareTo(SignalHead[s].targetAspect) != 0)){ // do we need to dim?
-      SignalHead[s].dimIndex++;
-      if (SignalHead[s].dimIndex > 7) SignalHead[s].dimIndex=0;
-      if ((SignalHead[s].dimPattern & (1 << SignalHead[s].dimIndex)) == 0) myPins = B11 << (s*2); // dimming
-
-      if (now > SignalHead[s].dimStep){                           // time to dim more
-        SignalHead[s].dimStep = now + dimStepTime;
-        if ((SignalHead[s].currentAspect.compareTo("DARK") == 0) & (SignalHead[s].targetAspect.compareTo("DARK") != 0)){  // we need to brighten
-          SignalHead[s].dimPattern = SignalHead[s].dimPattern*2 + 1;
-          if (SignalHead[s].targetAspect.compareTo("GREEN")) SignalHead[s].pin = 1;
-          else if (SignalHead[s].targetAspect.compareTo("RED")) SignalHead[s].pin = 2;
-          myPins = SignalHead[s].pin << (s*2);                   // enable high pin
-
-          if (SignalHead[s].dimPattern == 255){                   // were done
-            SignalHead[s].currentAspect = SignalHead[s].targetAspect;
-          }
-        } else {                                                  // we need to darken
-          SignalHead[s].dimPattern = SignalHead[s].dimPattern >> 1;
-          if (SignalHead[s].dimPattern <= 0){                     // were done
-            SignalHead[s].currentAspect = "DARK";                 // switch to brightning
-            SignalHead[s].targetAspect = SignalHead[s].aspect;
-            myPins = B11 << (s*2);                                // dark for both pins high
-          }
-        }
+
+// Append to reply when the whole text fits, so a reply that is too long loses entries at the
+// end instead of ending in half a name. False when it did not fit.
+boolean appendReply(size_t &used, const char* format, ...){
+  va_list args;
+  va_start(args, format);
+  int added = vsnprintf(reply + used, sizeof(reply) - used, format, args);
+  va_end(args);
+  if ((added < 0) || (used + added >= sizeof(reply))){
+    reply[used] = 0;
+    return false;
+  }
+  used += added;
+  return true;
+}
+
+
+void headQuery(int s, const payloadWord &pl){
+  if (pl.type == PAYLOAD_QUERY){                                  // did we receive a head query
+    trace(TRACE_QUERY, s, headState(s), 0);
+    markDirty(s);
+  } else trace(TRACE_UNKNOWN, s, headState(s), pl.type);
+}
+
+
+// a message for one of the heads, false when the head or the topic form is not ours
+boolean headMessage(const topicTokens &tokens, const payloadWord &pl){
+  int s = -1;
+  if (tokenIs(tokens, 0, "light")){
+    if ((tokens.count >= 3) && tokenIs(tokens, 1, "set")){       // light/set/<head>-<colour> or light/set/<head>/<colour>
+      if (tokens.count == 4){
+        s = findHead(tokens.text[2], tokens.len[2]);
+        if (s >= 0) headCommand(s, matchColour(tokens.text[3], tokens.len[3]), pl);
+      } else {
+        const char* dash = (const char*)memrchr(tokens.text[2], '-', tokens.len[2]);
+        if (dash == NULL) return false;
+        int headLen = dash - tokens.text[2];
+        colour_t colour = matchColour(dash + 1, tokens.len[2] - headLen - 1);
+        if (colour == COLOUR_NONE) return false;
+        s = findHead(tokens.text[2], headLen);
+        if (s >= 0) headCommand(s, colour, pl);
       }
-        if (DEBUG && (s==3)) {
-          Serial.print(SignalHead[s].currentAspect);
-          Serial.print(">");
-          Serial.print(SignalHead[s].targetAspect);
-          Serial.print(" ");
-          printBinary(SignalHead[s].dimPattern);
-          Serial.print(" ");
-          if (SignalHead[s].flash) Serial.print("F");
-          else Serial.print("_");
-          Serial.print(" ");
-          printBinary(myPins);
-          Serial.print(" ");
-          printBinary(signalPins);
-          Serial.println();
-        }
+    } else if (tokens.count >= 2){                                // light/<head>/...
+      s = findHead(tokens.text[1], tokens.len[1]);
+      if (s >= 0) headQuery(s, pl);
     }
+  } else {
+    s = findHead(tokens.text[0], tokens.len[0]);
+    if ((tokens.count == 2) && tokenIs(tokens, 1, "set")){
+      if (s >= 0) headCommand(s, COLOUR_NONE, pl);
+    } else if (tokens.count == 1){
+      if (s >= 0) headQuery(s, pl);
+    } else return false;
+  }
+  return s >= 0;
+}
+
+
+// The topic is split into its levels once, the head is looked up in the name index and the
+// payload in the payload table, so the work per message does not grow with the number of heads.
+// Everything works on the buffers PubSubClient hands us and on fixed buffers, nothing is
+// allocated per message, so bursts from JMRI do not fragment the heap.
+//   <prefix><myHostname>[/...]                 server commands
+//   <prefix><head>/set                         payload aspect
+//   <prefix>light/set/<head>-<colour>          payload ON | OFF
+//   <prefix>light/set/<head>/<colour>          payload ON | OFF
+//   <prefix><head>, <prefix>light/<head>/...   payload ?
+void callback(char* topic, byte* payload, unsigned int length) {
+  uint32_t start = halCycles();
+#if defined(CAPTURE)
+  captureMessage(topic, payload, length);
+#endif
+  handleMessage(topic, payload, length);
+  sectionEnd(SECTION_CALLBACK, start);
+}
+
+
+void handleMessage(char* topic, byte* payload, unsigned int length) {
+  msgCnt++;                                                       // stats, messages handled
+
+  size_t prefixLen = strlen(topicPrefix);
+  topicTokens tokens;
+  tokens.count = 0;
+  if (strncmp(topic, topicPrefix, prefixLen) == 0) splitTopic(topic + prefixLen, tokens);
+  if ((tokens.count == 0) || (tokens.count > maxTopicTokens)){    // not a signal topic we know
+    msgDropped++;
+    trace(TRACE_DROPPED, -1, 0, 0);
+    return;
+  }
+
+  if (tokenIs(tokens, 0, myHostname)){                           // do we have server commands to process?
+    if ((tokens.count == 2) && tokenIs(tokens, 1, "batch")) batchCommand(payload, length);
+    else serverCommands(payload, length);
+    return;
+  }
+  if (!headMessage(tokens, matchPayload(payload, length))){      // not one of our heads
+    msgDropped++;
+    trace(TRACE_DROPPED, -1, 0, 0);
+  }
+} // end callback
 
-    outherPins = 0xFF ^ mask;                                     // mask for pins to retain
-    signalPins = (signalPins & outherPins) | myPins ;             // insert pin states for current head
-  }
-  digitalWrite(latchPin, LOW);
-  shiftOut(dataPin, clockPin, MSBFIRST, signalPins);              // finally we write to shift register
-  digitalWrite(latchPin, HIGH);
-
-  // MQTT publish state
-  if ((now > nextPublish) ){                       // is it time to publish?
-    nextPublish = now + publish_delay;
-    String payload = "";
-    payload = utcTime();                                          // publish the current time
-    String level = topicPrefix;
-    level += myHostname;
-    level += "/";
-    level += "time";
-    client.publish((char*)level.c_str(), (char*)payload.c_str());
-
-    payload = String(cycleStats/(publish_delay/cyclePeriod));     // publish stats
-    cycleStats = 0;
-    level = topicPrefix;
-    level += myHostname;
-    level += "/stats";
-    client.publish((char*)level.c_str(), (char*)payload.c_str());
-  }
-  if (DEBUG) delay(500);            // debug slow down so we can see what is happening
-} // end of main loop
 
 
 // =============================================================================== //
-//                               MQTT processing                                   //
+//                    WiFi and MQTT connection state machine                       //
 // =============================================================================== //
-
-void callback(char* topic, byte* payload, unsigned int length) {
-  if (DEBUG){
-    Serial.print("Message arrived [");                              // show what we received
-    Serial.print(topic);
-    Serial.print("] '");
-  }
-  String pl ="";
-  String tmpAspect;
-  String topicStr = topic;
-
-  for (unsigned int i = 0; i < length; i++) {
-    if (DEBUG) Serial.print((char)payload[i]);
-    pl += (char)payload[i];
-  }
-  if (DEBUG) Serial.println("'");
-
-  if (topicStr.indexOf(myHostname) > -1) serverCommands(topicStr, pl);  // do we have server commands to process?
-  else for(int s=0; s<numSignalHeads; s++){                             // do we receive a topic?
-    String topicPub = topicPrefix;
-    topicPub += SignalHead[s].name;
-    if ( topicStr.indexOf(SignalHead[s].name) > -1){
-      if ( topicStr.indexOf("set") > -1 ){                                      // did we receive a set command?
-        // payload OFF only for flashing and only when the aspect is changing
-        if (topicStr.indexOf("flashing") > -1){
-          if (topicStr.indexOf("flashing") > -1) {
-            if (DEBUG) publishAspect(s);
-            if (pl.compareTo("OFF") == 0) {
-              // tmpAspect = SignalHead[s].aspect.substring(8);
-              // publishDebug(tmpAspect);
-              // SignalHead[s].aspect = tmpAspect;
-              // SignalHead[s].targetAspect = tmpAspect;
-              SignalHead[s].flash = false;
-              // SignalHead[s].dimPattern = 255;
-              // publishAspect(s);
-              publishFlashing(s);
-            } else {
-              // SignalHead[s].targetAspect = SignalHead[s].aspect;
-              // tmpAspect = "FLASHING";
-              // tmpAspect += SignalHead[s].aspect;
-              // publishDebug(tmpAspect);
-              // SignalHead[s].aspect = tmpAspect;
-              SignalHead[s].flash = true;
-              // SignalHead[s].dimPattern = 255;
-              // SignalHead[s].flashingAspect = SignalHead[s].targetAspect;
-              // publishAspect(s);
-              publishFlashing(s);
-            }
-          }
+// The LEDs are refreshed by the timer interrupt whatever happens here, and this returns right
+// away unless an attempt is due. An attempt is a DNS lookup and a TCP connect with short
+// timeouts, so even a dead broker only stalls fades for about a second per attempt.
+void manageConnection(){
+  uint32_t sectionStart;
+  net_t before = netState;
+  boolean wifiUp = (WiFi.status() == WL_CONNECTED);
+  switch (netState){
+    case NET_WIFI_DOWN:
+      if (wifiUp){
+        Serial.print("WiFi connected, IP address: ");
+        Serial.println(WiFi.localIP());
+        if (!otaStarted){
+          ArduinoOTA.begin();
+          otaStarted = true;
+        }
+        brokerResolved = false;                                    // may be another network
+        backoff = backoffMin;
+        nextAttempt = now;
+        netState = NET_MQTT_DOWN;
+      } else if (msSince(nextAttempt) >= 0){                       // the stack did not get back on its own
+        Serial.println("WiFi still down, connecting again");
+        WiFi.disconnect();
+        WiFi.begin(MY_SSID, SSID_PSW);
+        nextAttempt = now + wifiRetryTime;
+      }
+      break;
+    case NET_MQTT_DOWN:
+      if (!wifiUp){
+        netState = NET_WIFI_DOWN;
+        nextAttempt = now + wifiRetryTime;
+        break;
+      }
+      if (msSince(nextAttempt) < 0) break;
+      sectionStart = halCycles();
+      if (reconnect()){
+        backoff = backoffMin;
+        netState = NET_UP;
+      } else {
+        long jitter = random(backoff / 2 + 1) - backoff / 4;      // +/- 25%
+        nextAttempt = now + backoff + jitter;
+        backoff = min(2 * backoff, (long)backoffMax);
+      }
+      sectionEnd(SECTION_RECONNECT, sectionStart);
+      break;
+    case NET_UP:
+      if (!wifiUp || !halMqttConnected()){
+        Serial.println("Connection to the broker lost");
+        netLost++;
+        if (wifiUp){
+          nextAttempt = now + random(backoffMin);                  // first retry soon, but not all servers at once
+          netState = NET_MQTT_DOWN;
         } else {
-          if (DEBUG){
-            message = "reveived ON command:" ;
-            message += topicStr;
-            message += "=";
-            message += pl;
-            publishDebug(message);
-          }
-          if (pl.equalsIgnoreCase("GREEN") || ((topicStr.indexOf("green") >-1)&& (pl.compareTo("ON") == 0))){   // did we receive green aspect?
-            SignalHead[s].aspect = "GREEN";
-            SignalHead[s].targetAspect = "DARK";
-            SignalHead[s].flash = false;
-          } else if (pl.equalsIgnoreCase("RED") || ((topicStr.indexOf("red") >-1) && (pl.compareTo("ON") == 0)) ){
-            SignalHead[s].aspect = "RED";
-            SignalHead[s].targetAspect= "DARK";
-            SignalHead[s].flash = false;
-          } else if (pl.equalsIgnoreCase("YELLOW") || ((topicStr.indexOf("yellow") >-1) && (pl.compareTo("ON") == 0)) ){
-            SignalHead[s].aspect = "YELLOW";
-            SignalHead[s].targetAspect= "DARK";
-            SignalHead[s].flash = false;
-          } else if (pl.equalsIgnoreCase("DARK")){
-            SignalHead[s].aspect = "DARK";
-            SignalHead[s].targetAspect = "DARK";
-            SignalHead[s].flash = false;
-          } else if (pl.equalsIgnoreCase("FLASHINGGREEN")){
-            SignalHead[s].aspect = "GREEN";
-            SignalHead[s].targetAspect= "DARK";
-            SignalHead[s].flash = true;
-          } else if (pl.equalsIgnoreCase("FLASHINGRED")){
-            SignalHead[s].aspect = "RED";
-            SignalHead[s].targetAspect= "DARK";
-            SignalHead[s].flash = true;
-          } else if (pl.equalsIgnoreCase("FLASHINGYELLOW")){
-            SignalHead[s].aspect = "YELLOW";
-            SignalHead[s].targetAspect= "DARK";
-            SignalHead[s].flash = true;
-          }
-          if (SignalHead[s].aspect.compareTo(SignalHead[s].currentAspect) != 0){
-            client.publish(topicPub.c_str(), trueAspect(SignalHead[s]).c_str());
-            publishAspect(s);
-          }
+          nextAttempt = now + wifiRetryTime;
+          netState = NET_WIFI_DOWN;
         }
-      } else if (pl.compareTo("?") == 0){                                    // did we receive a head query
-        publishDebug("we're publishing on equest:");
-        client.publish(topicPub.c_str(), trueAspect(SignalHead[s]).c_str());
-        publishAspect(s);
-      }else if (DEBUG) {
-        message = "Command received, that I don't understand! : ";
-        message += topicStr;
-        message += "=";
-        message += pl;
-        publishDebug(message);
+        break;
       }
-    }
+      sectionStart = halCycles();
+      halMqttPoll();
+      sectionEnd(SECTION_MQTT, sectionStart);
+      break;
   }
-} // end callback
-
+  if (netState != before) trace(TRACE_NET, -1, before, netState);
+}
 
 
+// one connection attempt to the broker, false when it failed
 boolean reconnect() {
   String topic = topicPrefix;
   topic += myHostname;
+  if (!brokerResolved){                                            // look the broker up once per WiFi connection
+    if (!WiFi.hostByName(mqtt_server, brokerIP, dnsTimeout)){
+      Serial.println("Broker address not found");
+      return false;
+    }
+    client.setServer(brokerIP, mqtt_port);
+    brokerResolved = true;
+  }
   Serial.print("Attempting MQTT connection from ");
   Serial.print(WiFi.localIP());
   Serial.print(" as ");
@@ -491,15 +1083,48 @@ boolean reconnect() {
     Serial.println("connected");
 
     // Once connected, publish an announcement...
-    client.publish((char*)topic.c_str(), (char*)"Reconnected");
+    halPublish((char*)topic.c_str(), (char*)"Reconnected");
     Serial.println("connected to MQTT server");
 
     // ... and resubscribe
-    topic = topicPrefix;
-    topic += "#";
-    client.subscribe((char*)topic.c_str());
+    subscribeTopics();
+    static boolean bootPublished = false;
+    if (!bootPublished){
+      publishBoot();
+      publishOta();                                                // the update that brought us here
+    }
+    bootPublished = true;
+  } else brokerResolved = false;                                   // look it up again, it may have moved
+  return halMqttConnected();
+}
+
+
+// Subscribe to the command topic of this server and the topics of our own heads only, so we are
+// not woken up for the heads of the other servers or for everybody's time and stats.
+// The light/<head>/... query form is only received with SUBSCRIBE_ALL, that is where we publish our state.
+void subscribeTopics(){
+#if defined(SUBSCRIBE_ALL)
+  snprintf(pubTopic, sizeof(pubTopic), "%s#", topicPrefix);
+  halSubscribe(pubTopic);
+#else
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s", topicPrefix, myHostname);   // server commands
+  halSubscribe(pubTopic);
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/batch", topicPrefix, myHostname);
+  halSubscribe(pubTopic);
+  for (int s=0; s<numSignalHeads; s++){
+    if (Heads.name[s] == NULL) continue;                          // unused output
+    snprintf(pubTopic, sizeof(pubTopic), "%s%s", topicPrefix, Heads.name[s]);            // query
+    halSubscribe(pubTopic);
+    snprintf(pubTopic, sizeof(pubTopic), "%s%s/set", topicPrefix, Heads.name[s]);        // aspect
+    halSubscribe(pubTopic);
+    snprintf(pubTopic, sizeof(pubTopic), "%slight/set/%s/+", topicPrefix, Heads.name[s]);
+    halSubscribe(pubTopic);
+    for (int c=COLOUR_GREEN; c<=COLOUR_FLASHING; c++){           // a wildcard cannot match the -<colour> suffix
+      snprintf(pubTopic, sizeof(pubTopic), "%slight/set/%s-%s", topicPrefix, Heads.name[s], colourNames[c]);
+      halSubscribe(pubTopic);
+    }
   }
-  return client.connected();
+#endif
 }
 
 
@@ -535,98 +1160,1156 @@ void showTime(){
 }
 
 
-// when is green or red for yellow mix
-boolean isGreen(uint8_t *yellowCycle){          // do we need to show green
-  int bit7 = (*yellowCycle & B10000000)/128;    // get top bit of pattern
-  *yellowCycle = *yellowCycle << 1;             // cycle all bits
-  *yellowCycle = *yellowCycle | bit7;           // add bit to low end of the byte
-  return(bit7 == 1);                            // if the bit is a 1 then it's green
+// =============================================================================== //
+//                                Frame building                                   //
+// =============================================================================== //
+
+// =============================== head name index =============================== //
+// open addressing hash table from head name to head number, built at startup for the built in
+// heads, loaded ready made with a configuration image
+#define headIndexSize headIndexSizeFor(numSignalHeads)
+int16_t headIndex[headIndexSize];               // head number, -1 for an empty slot
+
+void buildHeadIndex(){
+  for (int i=0; i<headIndexSize; i++) headIndex[i] = -1;
+  for (int s=0; s<numSignalHeads; s++){
+    if (Heads.name[s] == NULL) continue;                          // unused output
+    int len = strlen(Heads.name[s]);
+    if (findHead(Heads.name[s], len) >= 0){
+      Serial.print("Duplicate head name ignored: ");
+      Serial.println(Heads.name[s]);
+      continue;
+    }
+    uint32_t slot = nameHash(Heads.name[s], len) & (headIndexSize - 1);
+    while (headIndex[slot] >= 0) slot = (slot + 1) & (headIndexSize - 1);
+    headIndex[slot] = s;
+  }
+}
+
+int findHead(const char* name, int len){        // head number for a name that need not be 0 terminated, or -1
+  uint32_t slot = nameHash(name, len) & (headIndexSize - 1);
+  while (headIndex[slot] >= 0){
+    const char* candidate = Heads.name[headIndex[slot]];
+    if ((strncmp(candidate, name, len) == 0) && (candidate[len] == 0)) return headIndex[slot];
+    slot = (slot + 1) & (headIndexSize - 1);
+  }
+  return -1;
+}
+
+
+// ============================== head plane access ============================== //
+// scalar access to one head in the bit sliced planes, used outside the frame loop
+
+uint8_t getHead(const uint32_t* plane, int s){           // the 2 bit field of head s
+  return (plane[s >> 4] >> ((s & 15) * 2)) & B11;
+}
+
+void setHead(uint32_t* plane, int s, uint8_t value){
+  uint8_t shift = (s & 15) * 2;
+  plane[s >> 4] = (plane[s >> 4] & ~(3UL << shift)) | ((uint32_t)value << shift);
+}
+
+void setHeadFlag(uint32_t* plane, int s, boolean on){   // flags fill both bits of the field
+  setHead(plane, s, on ? B11 : B00);
+}
+
+uint8_t getHeadBits(uint32_t planes[][numHeadWords], int bits, int s){  // gather a value spread over planes
+  int w = s >> 4;
+  uint8_t shift = (s & 15) * 2;
+  uint8_t value = 0;
+  for (int b=0; b<bits; b++) value |= ((planes[b][w] >> shift) & 1) << b;
+  return value;
+}
+
+void setHeadBits(uint32_t planes[][numHeadWords], int bits, int s, uint8_t value){
+  int w = s >> 4;
+  uint32_t field = 3UL << ((s & 15) * 2);
+  for (int b=0; b<bits; b++) planes[b][w] = ((value >> b) & 1) ? (planes[b][w] | field) : (planes[b][w] & ~field);
+}
+
+
+void initHeads(){                               // named heads start dark and warm up to red
+  for (int s=0; s<numSignalHeads; s++){
+    setHead(Heads.aspect, s, (Heads.name[s] == NULL) ? ASPECT_DARK : ASPECT_RED);
+    setHead(Heads.currentAspect, s, ASPECT_DARK);
+    setHead(Heads.targetAspect, s, getHead(Heads.aspect, s));
+    setHeadFlag(Heads.flash, s, false);
+    setHead(Heads.pin, s, B11);
+    setHeadBits(Heads.dimPattern, 8, s, 0);
+    setHeadFlag(Heads.dimmed, s, true);
+    Heads.dimStep[s] = 0;
+    Heads.fadeStep[s] = 0;
+  }
+}
+
+
+// A fade step of head s: warm up the colour it shows or cool it down, along the curves of its bulb.
+// Steps are timed, a late step catches up, so a fade takes the same time at any loop rate.
+// fresh is set when the head just started to fade and its dimStep is stale.
+void dimStepHead(int s, boolean fresh){
+  uint8_t current = getHead(Heads.currentAspect, s);
+  uint8_t target = getHead(Heads.targetAspect, s);
+  uint8_t step = Heads.fadeStep[s];
+  if (current == ASPECT_DARK){                                    // fully dark, time for the new aspect
+    if (target == ASPECT_DARK){
+      target = getHead(Heads.aspect, s);
+      setHead(Heads.targetAspect, s, target);
+      if (target == ASPECT_DARK) return;
+    }
+    uint8_t from = headState(s);
+    current = target;                                             // warm up the target colour
+    setHead(Heads.currentAspect, s, current);
+    setHead(Heads.pin, s, (current == ASPECT_GREEN) ? B10 : B01); // enable high pin
+    trace(TRACE_LIT, s, from, 0);
+    step = 0;
+    fresh = true;
+  }
+  boolean cooling = (current != target);
+  const fadeCurve &curve = cooling ? bulbTypes[Heads.bulb[s]].cool : bulbTypes[Heads.bulb[s]].warm;
+  if (cooling != ((step & fadeCooling) != 0)){                    // the fade turned, go on from the level we show
+    uint8_t level = getHeadBits(Heads.dimPattern, 8, s);
+    step = 0;
+    while ((step < fadeSteps - 1) && (cooling ? (curve.level[step] > level) : (curve.level[step] < level))) step++;
+  }
+  step &= ~fadeCooling;
+  int steps = 0;                                                  // steps due, late ones caught up
+  if (fresh) Heads.dimStep[s] = now;
+  else {
+    long late = msSince(Heads.dimStep[s]);
+    steps = (late < curve.stepTime) ? 1 : 1 + late / curve.stepTime;
+    Heads.dimStep[s] += (long)(steps - 1) * curve.stepTime;
+  }
+  Heads.dimStep[s] += curve.stepTime;
+  step = (step + steps < fadeSteps - 1) ? step + steps : fadeSteps - 1;
+  uint8_t level = curve.level[step];
+  boolean dark = cooling && (level == 0);
+  uint8_t from = dark ? headState(s) : 0;
+  if (dark){                                                      // were done
+    setHead(Heads.currentAspect, s, ASPECT_DARK);                 // switch to warming up
+    setHead(Heads.targetAspect, s, getHead(Heads.aspect, s));
+  }
+  Heads.fadeStep[s] = step | (cooling ? fadeCooling : 0);
+  setHeadBits(Heads.dimPattern, 8, s, level);
+  setHeadFlag(Heads.dimmed, s, level != 255);
+  if (dark) trace(TRACE_DARK, s, from, step);
+  else if ((traceStepHead == s) || (traceStepHead == traceAllHeads)) trace(TRACE_STEP, s, headState(s), step);
+}
+
+
+// the head state is bit sliced, every step works on the 2 bit fields of 16 heads at once
+const uint32_t lowBits = 0x55555555;            // the low bit of every 2 bit field
+long nextDimStep = 0;                           // earliest dim step of the heads that were fading
+uint32_t wasFading[numHeadWords];               // heads that were fading in the previous pass
+
+inline uint32_t fieldMask(uint32_t low){        // spread the low bits over both bits of the field
+  return low | (low << 1);
+}
+
+inline uint32_t fadingHeads(int w){             // heads that have to warm up, cool down or take their new aspect
+  uint32_t current = Heads.currentAspect[w];
+  uint32_t target = Heads.targetAspect[w];
+  uint32_t change = (current ^ target) | ((target ^ Heads.aspect[w]) & ~Heads.flash[w]);
+  uint32_t dim = (target | (target >> 1)) & Heads.dimmed[w];   // to be lit, not at full brightness
+  return fieldMask((change | (change >> 1) | dim) & lowBits);
+}
+
+
+// advance flashing and fading of all heads
+// only the fade steps (every stepTime of the curve per fading head) are handled per head
+void updateHeads(){
+  const uint32_t flashMask = flashOn ? 0xFFFFFFFF : 0;
+  boolean stepDue = msSince(nextDimStep) > 0;
+  long earliest = now;                          // first dim step of the heads looked at, now when none
+  boolean stepping = false;
+  uint32_t busy = 0;                            // fading or flashing heads
+
+  for (int w=0; w<numHeadWords; w++){
+    uint32_t flash = Heads.flash[w];            // flashing heads follow the flash state
+    Heads.targetAspect[w] = (Heads.targetAspect[w] & ~flash) | (Heads.aspect[w] & flash & flashMask);
+
+    uint32_t fading = fadingHeads(w);
+    uint32_t fresh = fading & ~wasFading[w];    // started fading since the last pass
+    uint32_t scan = (stepDue ? fading : fresh) & lowBits;
+    wasFading[w] = fading;
+    busy |= fading | flash;
+    while (scan){                               // fade steps of the heads in this word
+      int bit = __builtin_ctz(scan);
+      int s = w*16 + (bit >> 1);
+      scan &= scan - 1;
+      boolean isFresh = (fresh >> bit) & 1;
+      if (isFresh || (msSince(Heads.dimStep[s]) > 0)){  // time to fade more
+        dimStepHead(s, isFresh);
+        framesDirty = true;
+      }
+      if (!stepping || (msSince(Heads.dimStep[s]) > msSince(earliest))) earliest = Heads.dimStep[s];
+      stepping = true;
+    }
+  }
+  if (stepDue) nextDimStep = earliest;          // all fading heads were looked at, due again right away when none
+  else if (stepping && (msSince(earliest) > msSince(nextDimStep))) nextDimStep = earliest;
+  headsIdle = (busy == 0);
+}
+
+
+// Apply the commands waiting in the head slots, once per pass. A burst from JMRI re-evaluating
+// a mast, like RED, GREEN and flashing ON within a few ms, ends up as its net change: only a
+// head that gets another aspect fades over, and each changed head is published once. Heads
+// set by a batch are not, its one reply already told their state.
+void applyCommands(){
+  for (int w=0; w<numHeadWords; w++){
+    uint32_t pending = Heads.pending[w];
+    if (pending == 0) continue;
+    headsIdle = false;                          // updateHeads() has work again
+    uint32_t diff = Heads.pendingAspect[w] ^ Heads.aspect[w];
+    uint32_t changed = pending & fieldMask((diff | (diff >> 1)) & lowBits);   // heads getting another aspect
+    uint32_t flash = (Heads.flash[w] & ~pending) | (Heads.pendingFlash[w] & pending);
+    uint32_t flashChanged = flash ^ Heads.flash[w];
+    uint32_t traced = (changed | flashChanged) & lowBits;
+    uint8_t from[16];                           // state before, for the trace
+    for (uint32_t scan = traced; scan; scan &= scan - 1){
+      int h = __builtin_ctz(scan) >> 1;
+      from[h] = headState(w*16 + h);
+    }
+
+    Heads.aspect[w] = (Heads.aspect[w] & ~changed) | (Heads.pendingAspect[w] & changed);
+    Heads.targetAspect[w] &= ~changed;          // DARK, the colour shown fades out first
+    Heads.flash[w] = flash;
+    Heads.pending[w] = 0;
+    if (changed | flashChanged) snapshotDirty = true;
+    diff = Heads.aspect[w] ^ Heads.currentAspect[w];
+    publishDirty[w] |= (changed | flashChanged | (pending & fieldMask((diff | (diff >> 1)) & lowBits))) & ~Heads.pendingBatch[w];
+    Heads.pendingBatch[w] = 0;
+
+    for (uint32_t scan = traced; scan; scan &= scan - 1){
+      int h = __builtin_ctz(scan) >> 1;
+      trace(TRACE_COMMAND, w*16 + h, from[h], 0);
+    }
+  }
+}
+
+
+// The flash state follows the time of day on the NTP clock, so the heads of every server, and
+// of one server before and after a reconnect, flash in step without any messages. A day holds
+// a whole number of flash periods, so midnight does not skip a beat. Until SNTP has set the
+// clock the server flashes on its own millis().
+boolean flashPhase(){
+  uint32_t ms;
+  flashSynced = halWallClockMs(ms);
+  if (!flashSynced) ms = now;
+  return ((ms / flashTime) & 1) == 0;
+}
+
+
+// An idle pass waits a little for the network instead of spinning. With IDLE_SLEEP and frames
+// that do not change between sub frames, the registers hold the picture by themselves, so WiFi
+// may light sleep between beacons, even if that stalls the refresh interrupt.
+void idleWait(){
+  boolean idle = headsIdle && !framesDirty;
+#if defined(IDLE_SLEEP)
+  boolean sleep = idle && framesConstant && (frontBuffer == readyBuffer);
+  if (sleep != sleeping){
+    sleeping = sleep;
+    WiFi.setSleepMode(sleep ? WIFI_LIGHT_SLEEP : WIFI_MODEM_SLEEP);
+  }
+#endif
+  if (!idle) return;
+  idleLoops++;
+  delay(idleDelay);
+}
+
+
+#if defined(RENDER_PER_HEAD)
+// reference renderer: process every signal head one at a time
+void renderFrames(uint8_t frames[subFrames][numShiftRegisters]){
+  for (int f=0; f<subFrames; f++){
+    boolean setGreen = bitRead(yellowCycle, f);                   // do we show green or red?
+    for(int s=0; s<numSignalHeads; s++){                          // process for every signal head
+      uint8_t myPins = getHead(Heads.pin, s);                     // get from aspect
+      if (getHead(Heads.currentAspect, s) == ASPECT_YELLOW){      // for Yellow we need to alternate colours
+        if (setGreen) myPins = B10;                               // show green
+        else myPins = B01;                                        // or red
+      } else if (getHead(Heads.currentAspect, s) == ASPECT_DARK){ // for dark
+        myPins = B11;                                             // dark for both pins high
+      }
+      if ((getHeadBits(Heads.dimPattern, 8, s) & (1 << f)) == 0) myPins = B11;  // off in this sub frame
+      uint8_t shift = (s % headsPerRegister) * 2;                 // position of the head in its register
+      uint8_t &reg = frames[f][s / headsPerRegister];
+      reg = (reg & ~(B11 << shift)) | (myPins << shift);          // insert pin states for current head
+    }
+  }
+}
+
+#else
+// bit sliced renderer: 16 heads per word, no per head branches
+void renderFrames(uint8_t frames[subFrames][numShiftRegisters]){
+  for (int w=0; w<numHeadWords; w++){
+    uint32_t current = Heads.currentAspect[w];
+    uint32_t yellow = fieldMask(current & (current >> 1) & lowBits);     // current is B11
+    uint32_t dark = fieldMask(~(current | (current >> 1)) & lowBits);    // current is B00
+    uint32_t pins = (Heads.pin[w] & ~(yellow | dark)) | dark;
+    for (int f=0; f<subFrames; f++){
+      uint32_t yellowPins = bitRead(yellowCycle, f) ? 0xAAAAAAAA : 0x55555555;  // B10 green or B01 red in every field
+      uint32_t frame = pins | (yellowPins & yellow) | ~Heads.dimPattern[f][w];
+      for (int b=0; b<4; b++){                  // copy the word into the register bytes
+        if (w*4 + b < numShiftRegisters) frames[f][w*4 + b] = frame >> (b*8);
+      }
+    }
+  }
 }
+#endif
 
 
-void printBinary(byte inByte) {
-  for (int b = 7; b >= 0; b--) {
-    Serial.print(bitRead(inByte, b) ? '1' : '0');
+// ================================= LED refresh ================================= //
+// timer interrupt, shifts out the next sub frame. Only touches IRAM code and RAM.
+// A sub frame equal to what the registers already hold is skipped, so steady heads cost
+// a compare per tick instead of a transfer and a latch.
+void IRAM_ATTR refreshIsr(){
+  uint8_t shown = (refreshPhase + subFrames - halLatchDelay) % subFrames;  // the sub frame the LEDs show from now on
+  halNextRefresh(bcmLsbTicks << shown);                           // sub frame n lasts 2^n LSB times
+  halLatchIsr();                                                  // show what the last tick sent
+  if (refreshPhase == 0) frontBuffer = readyBuffer;              // take new frames at the start of a cycle
+  const uint8_t* frame = frameBuffer[frontBuffer][refreshPhase];
+  boolean dirty = false;
+  for (int r=0; r<numShiftRegisters; r++){
+    if (frame[r] != lastFrame[r]){
+      lastFrame[r] = frame[r];
+      dirty = true;
+    }
   }
+  if (dirty){
+    uint32_t shiftStart = halCycles();
+    halShiftOutIsr(frame, numShiftRegisters);
+    sectionEnd(SECTION_SHIFT, shiftStart);
+    framesWritten++;
+  } else framesSkipped++;
+  refreshPhase = (refreshPhase + 1) % subFrames;
+  refreshTicks++;
 }
 
 
+const char* lightNames[] = {"green", "yellow", "red", "flashing"};  // the lights JMRI knows per head
+
 void publishAspect(int s){
-  String pubTopic = topicPrefix;
-  pubTopic += "light/";
-  pubTopic += SignalHead[s].name;
-  pubTopic += "/";
-
-  String topicPub = pubTopic;
-  String pubMsg = "OFF";
-  topicPub += "green";
-  if (SignalHead[s].aspect.indexOf("GREEN") > -1 ) pubMsg = "ON";
-  client.publish((char*) topicPub.c_str(), (char*) pubMsg.c_str());
-
-  topicPub = pubTopic;
-  pubMsg = "OFF";
-  topicPub += "yellow";
-  if (SignalHead[s].aspect.indexOf("YELLOW") > -1 ) pubMsg = "ON";
-  client.publish((char*) topicPub.c_str(), (char*) pubMsg.c_str());
-
-  topicPub = pubTopic;
-  pubMsg = "OFF";
-  topicPub += "red";
-  if (SignalHead[s].aspect.indexOf("RED") > -1 ) pubMsg = "ON";
-  client.publish((char*) topicPub.c_str(), (char*) pubMsg.c_str());
-
-  topicPub = pubTopic;
-  pubMsg = "OFF";
-  topicPub += "flashing";
-  if (SignalHead[s].aspect.indexOf("FLASHING") > -1 ) pubMsg = "ON";
-  client.publish((char*) topicPub.c_str(), (char*) pubMsg.c_str());
-}
-
-
-void publishFlashing(int s){
-  String pubTopic = topicPrefix;
-  pubTopic += "light/";
-  pubTopic += SignalHead[s].name;
-  pubTopic += "/";
-  pubTopic += "flashing";
-  String pubMsg = "OFF";
-  if (SignalHead[s].flash) pubMsg = "ON";
-  client.publish((char*) pubTopic.c_str(), (char*) pubMsg.c_str());
-}
-
-
-void publishDebug(String message){
-  String topic = topicPrefix;
-  topic += "DEBUG";
-  if (DEBUG) client.publish((char*)topic.c_str(), (char*)message.c_str());
+  for (int l=0; l<4; l++){
+    boolean on;
+    if (l == 3) on = getHead(Heads.flash, s);
+    else on = getHead(Heads.aspect, s) == ((l == 0) ? ASPECT_GREEN : (l == 1) ? ASPECT_YELLOW : ASPECT_RED);
+    snprintf(pubTopic, sizeof(pubTopic), "%slight/%s/%s", topicPrefix, Heads.name[s], lightNames[l]);
+    halPublish(pubTopic, on ? "ON" : "OFF");
+  }
+}
+
+
+void markDirty(int s){                          // publish the state of head s with the next flush
+  setHeadFlag(publishDirty, s, true);
 }
 
 
-String trueAspect(signal signalHead){
-  String ret ="";
-  if (signalHead.flash) ret = "FLASHING";
-  ret += signalHead.aspect;
-  return(ret);
+void publishHead(int s){
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s", topicPrefix, Heads.name[s]);
+  halPublish(pubTopic, trueAspect(s));
+  publishAspect(s);
 }
 
 
+#if defined(PUBLISH_SNAPSHOT)
+void publishSnapshot(){                         // one character per head: D G R Y, lower case when flashing, - unused
+  static char snapshot[numSignalHeads + 1];
+  for (int s=0; s<numSignalHeads; s++){
+    if (Heads.name[s] == NULL) snapshot[s] = '-';
+    else {
+      snapshot[s] = "DGRY"[getHead(Heads.aspect, s)];
+      if (getHead(Heads.flash, s)) snapshot[s] += 'a' - 'A';
+    }
+  }
+  snapshot[numSignalHeads] = 0;
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/snapshot", topicPrefix, myHostname);
+  halPublish(pubTopic, snapshot);
+}
+#endif
+
+
+// publish up to publishBudget dirty heads, the publish task runs once per publishWindow
+void publishDirtyHeads(){
+  if (!halMqttConnected()) return;                                 // dirty heads wait for the connection
+  int budget = publishBudget;
+  for (int i=0; (i<numHeadWords) && (budget > 0); i++){
+    int w = (publishCursor + i) % numHeadWords;
+    while (publishDirty[w] && (budget > 0)){
+      int s = w*16 + (__builtin_ctz(publishDirty[w]) >> 1);
+      setHeadFlag(publishDirty, s, false);
+      publishHead(s);
+      budget--;
+    }
+    publishCursor = publishDirty[w] ? w : (w + 1) % numHeadWords;
+  }
+#if defined(PUBLISH_SNAPSHOT)
+  if (budget < publishBudget) publishSnapshot();         // something changed
+#endif
+}
+
+
+void publishStats(){                      // publish the performance counters of this period
+  String level = topicPrefix;
+  level += myHostname;
+  level += "/stats";
+  String payload = String(cycleStats/(publish_delay/cyclePeriod)); // average loops per second
+  cycleStats = 0;
+  halPublish(level.c_str(), payload.c_str());
+
+  String topic = level + "/msgs";
+  payload = String((float)msgCnt/(publish_delay/1000));           // MQTT messages handled per second
+  msgCnt = 0;
+  halPublish(topic.c_str(), payload.c_str());
+
+  topic = level + "/dropped";
+  payload = String(msgDropped);                                   // MQTT messages that were not for us
+  msgDropped = 0;
+  halPublish(topic.c_str(), payload.c_str());
+
+  topic = level + "/idle";
+  payload = String((float)idleLoops/(publish_delay/1000));        // idle passes per second
+  idleLoops = 0;
+  halPublish(topic.c_str(), payload.c_str());
+
+  topic = level + "/flash";
+  halPublish(topic.c_str(), flashSynced ? "ntp" : "local");      // what the flash phase follows
+
+  topic = level + "/lost";
+  payload = String(netLost);                                      // times the broker connection was lost
+  netLost = 0;
+  halPublish(topic.c_str(), payload.c_str());
+
+  static unsigned long lastRefreshTicks = 0;
+  topic = level + "/refresh";
+  payload = String((float)(refreshTicks - lastRefreshTicks)/(publish_delay/1000)); // refresh ticks per second
+  lastRefreshTicks = refreshTicks;
+  halPublish(topic.c_str(), payload.c_str());
+
+  static unsigned long lastWritten = 0;
+  static unsigned long lastSkipped = 0;
+  topic = level + "/frames";                                      // sub frames written/skipped this period
+  payload = String(framesWritten - lastWritten);
+  payload += "/";
+  payload += String(framesSkipped - lastSkipped);
+  lastWritten = framesWritten;
+  lastSkipped = framesSkipped;
+  halPublish(topic.c_str(), payload.c_str());
+
+  publishMemory();
+}
 
-void serverCommands(String topicStr, String pl){ // do we have server commands to process?
-  String message = "";
-  String pubTopic = topicPrefix;
-  pubTopic += myHostname;
-  pubTopic += "/";
 
-  if(pl.compareTo("heads") == 0){           // for all heads publush their name
-    pubTopic += "heads";
+void sampleHeap(){                        // low water marks of the heap
+  uint32_t heap = ESP.getFreeHeap();
+  if (heap < heapLow) heapLow = heap;
+  if (msSince(nextBlockSample) >= 0){
+    nextBlockSample = now + 1000;
+    uint32_t block = ESP.getMaxFreeBlockSize();
+    if (block < blockLow) blockLow = block;
+  }
+}
+
+
+// <myHostname>/stats/heap  free heap, largest free block, fragmentation, their low water marks
+//                          since boot and the least free stack loop() ever had, in bytes
+// <myHostname>/stats/ram   static RAM of the head table and the buffers, set at compile time,
+//                          and the MQTT client buffer on the heap
+void publishMemory(){
+  const size_t ramHeads = sizeof(Heads) + sizeof(headNames) + sizeof(headBulbs) + sizeof(headIndex) + sizeof(configArena) + sizeof(publishDirty) + sizeof(wasFading);
+  const size_t ramFrames = sizeof(frameBuffer) + sizeof(lastFrame);
+  const size_t ramReply = sizeof(reply);
+  const size_t ramTrace = sizeof(traceBuf);
+#if defined(CAPTURE)
+  const size_t ramCapture = sizeof(captureBuf);
+#else
+  const size_t ramCapture = 0;
+#endif
+  static_assert(ramHeads + ramFrames + ramReply + ramTrace + ramCapture <= ramBudget,
+                "too many heads for the RAM of an ESP8266, lower numShiftRegisters, traceSize or captureSize");
+
+  snprintf(message, sizeof(message), "free %lu block %lu frag %u%% low %lu lowblock %lu stack %lu",
+           (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMaxFreeBlockSize(),
+           (unsigned)ESP.getHeapFragmentation(), (unsigned long)heapLow, (unsigned long)blockLow,
+           (unsigned long)ESP.getFreeContStack());
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/stats/heap", topicPrefix, myHostname);
+  halPublish(pubTopic, message);
+
+  snprintf(message, sizeof(message), "heads %u (%u per head) frames %u reply %u trace %u capture %u mqtt %u",
+           (unsigned)ramHeads, (unsigned)(ramHeads / numSignalHeads), (unsigned)ramFrames, (unsigned)ramReply,
+           (unsigned)ramTrace, (unsigned)ramCapture, (unsigned)client.getBufferSize());
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/stats/ram", topicPrefix, myHostname);
+  halPublish(pubTopic, message);
+}
+
+
+// =============================== session capture =============================== //
+#if defined(CAPTURE)
+boolean captureRecord(uint8_t type, const void* data, size_t length){  // append one record, false when it does not fit
+  if (!capturing) return false;
+  if (captureUsed + 5 + length > captureSize){
+    captureFull = true;
+    capturing = false;
+    return false;
+  }
+  uint32_t ms = now;
+  memcpy(captureBuf + captureUsed, &ms, 4);
+  captureBuf[captureUsed + 4] = type;
+  memcpy(captureBuf + captureUsed + 5, data, length);
+  captureUsed += 5 + length;
+  return true;
+}
+
+
+void captureMessage(const char* topic, const byte* payload, unsigned int length){
+  uint8_t record[2 + 255 + 255];
+  size_t topicLen = strlen(topic);
+  if (topicLen > 255) topicLen = 255;
+  if (length > 255) length = 255;
+  record[0] = topicLen;
+  record[1] = length;
+  memcpy(record + 2, topic, topicLen);
+  memcpy(record + 2 + topicLen, payload, length);
+  captureRecord(1, record, 2 + topicLen + length);
+}
+
+
+void captureFrames(uint8_t frames[subFrames][numShiftRegisters]){   // frames is the newest buffer, the other one the last render
+  if (!capturing) return;
+  if (captureFramesKnown && (memcmp(frames, frameBuffer[1 - readyBuffer], sizeof(frameBuffer[0])) == 0)) return;  // only changes
+  captureFramesKnown = captureRecord(2, frames, sizeof(frameBuffer[0]));
+}
+
+
+void captureHeads(){                                               // the chain and the head names, a dump replays on its own
+  uint8_t record[3 + 255];
+  uint16_t registers = numShiftRegisters;
+  memcpy(record, &registers, 2);
+  record[2] = subFrames;
+  captureRecord(0, record, 3);
+  for (uint16_t s=0; s<numSignalHeads; s++){
+    if (Heads.name[s] == NULL) continue;
+    size_t nameLen = strlen(Heads.name[s]);
+    if (nameLen > 255) nameLen = 255;
+    memcpy(record, &s, 2);
+    record[2] = nameLen;
+    memcpy(record + 3, Heads.name[s], nameLen);
+    captureRecord(3, record, 3 + nameLen);
+  }
+}
+
+
+void captureCommand(const char* arg, unsigned int length){
+  if ((length == 5) && (strncmp(arg, "start", 5) == 0)){
+    captureUsed = 0;
+    captureFull = false;
+    captureFramesKnown = false;
+    capturing = true;
+    captureHeads();
+  } else if ((length == 4) && (strncmp(arg, "stop", 4) == 0)){
+    capturing = false;
+  } else if ((length == 4) && (strncmp(arg, "dump", 4) == 0)){   // the records in chunks, then a summary
+    capturing = false;
+    snprintf(pubTopic, sizeof(pubTopic), "%s%s/capture", topicPrefix, myHostname);
+    for (size_t sent = 0; sent < captureUsed; sent += captureChunk){
+      size_t chunk = (captureUsed - sent > captureChunk) ? captureChunk : captureUsed - sent;
+      halPublishBinary(pubTopic, captureBuf + sent, chunk);
+    }
+    snprintf(message, sizeof(message), "%lu bytes%s", (unsigned long)captureUsed, captureFull ? ", full" : "");
+    snprintf(pubTopic, sizeof(pubTopic), "%s%s/capture/end", topicPrefix, myHostname);
+    halPublish(pubTopic, message);
+  }
+}
+#endif
+
+
+// ================================== trace log ================================== //
+uint8_t headState(int s){                       // packed as in trace.h
+  return getHead(Heads.aspect, s) | (getHead(Heads.targetAspect, s) << 2) |
+         (getHead(Heads.currentAspect, s) << 4) | (getHead(Heads.flash, s) ? 0x40 : 0);
+}
+
+
+// record an event, s is the head or -1, from its state before the event
+void trace(trace_t event, int s, uint8_t from, uint8_t arg){
+  if (tracePaused) return;
+  traceRecord &r = traceBuf[traceWritten % traceSize];
+  r.time = halMillis();
+  r.event = event;
+  r.from = from;
+  r.arg = arg;
+  if (s >= 0){
+    r.head = s;
+    r.to = headState(s);
+    r.level = getHeadBits(Heads.dimPattern, 8, s);
+    r.pins = getHead(Heads.pin, s);
+  } else {
+    r.head = traceNoHead;
+    r.to = arg;
+    r.level = 0;
+    r.pins = 0;
+  }
+  traceWritten++;
+}
+
+
+void traceSend(const traceRecord &r){
+  Serial.write(traceSync);
+  Serial.write((const uint8_t*)&r, sizeof(r));
+}
+
+
+// Send the records not sent yet over Serial, as many as fit in the UART buffer, so this never
+// waits. Records overwritten before we got to them are reported in a TRACE_LOST record.
+void traceDrain(){
+  static uint32_t lost = 0;
+  if (!traceSerial){
+    traceSent = traceWritten;
+    return;
+  }
+  if (traceWritten - traceSent > traceSize){
+    lost += traceWritten - traceSent - traceSize;
+    traceSent = traceWritten - traceSize;
+  }
+  while (Serial.availableForWrite() > (int)sizeof(traceRecord)){
+    if (lost){
+      uint8_t count = (lost > 255) ? 255 : lost;
+      traceRecord r = {(uint32_t)halMillis(), traceNoHead, TRACE_LOST, 0, 0, 0, 0, count};
+      traceSend(r);
+      lost -= count;
+    } else if (traceSent != traceWritten){
+      traceSend(traceBuf[traceSent % traceSize]);
+      traceSent++;
+    } else break;
+  }
+}
+
+
+void traceCommand(const char* arg, unsigned int length){
+  if ((length > 6) && (strncmp(arg, " head ", 6) == 0)){         // head <head> | all | none
+    if ((length == 9) && (strncmp(arg + 6, "all", 3) == 0)) traceStepHead = traceAllHeads;
+    else if ((length == 10) && (strncmp(arg + 6, "none", 4) == 0)) traceStepHead = -1;
+    else traceStepHead = findHead(arg + 6, length - 6);          // by name, -1 when unknown
+  } else if ((length == 10) && (strncmp(arg, " serial on", 10) == 0)){
+    traceSerial = true;
+  } else if ((length == 11) && (strncmp(arg, " serial off", 11) == 0)){
+    traceSerial = false;
+  } else if (length == 0){                                        // the records in chunks, then a summary
+    static uint8_t chunk[traceChunk * (1 + sizeof(traceRecord))];
+    uint32_t first = (traceWritten > traceSize) ? traceWritten - traceSize : 0;
+    size_t used = 0;
+    snprintf(pubTopic, sizeof(pubTopic), "%s%s/trace", topicPrefix, myHostname);
+    for (uint32_t i = first; i < traceWritten; i++){
+      chunk[used++] = traceSync;
+      memcpy(chunk + used, &traceBuf[i % traceSize], sizeof(traceRecord));
+      used += sizeof(traceRecord);
+      if ((used == sizeof(chunk)) || (i + 1 == traceWritten)){
+        halPublishBinary(pubTopic, chunk, used);
+        used = 0;
+      }
+    }
+    snprintf(message, sizeof(message), "%lu records, %lu overwritten", (unsigned long)(traceWritten - first), (unsigned long)first);
+    snprintf(pubTopic, sizeof(pubTopic), "%s%s/trace/end", topicPrefix, myHostname);
+    halPublish(pubTopic, message);
+  }
+}
+
+
+// ============================== timing statistics ============================== //
+void IRAM_ATTR sectionEnd(section_t section, uint32_t start){    // account the time since start to section
+  uint32_t cycles = halCycles() - start;
+  sectionStats &stats = sections[section];
+  stats.cycles += cycles;
+  stats.calls++;
+  if (cycles > stats.maxCycles) stats.maxCycles = cycles;
+}
+
+
+void loopTime(uint32_t cycles){
+  int bucket = cycles ? 32 - __builtin_clz(cycles) : 0;           // 2^(n-1) <= cycles < 2^n
+  loopHist[min(bucket, loopBuckets - 1)]++;                       // 2^31 cycles and up (27 s at 80 MHz) would be 32
+  if (cycles > loopMaxCycles) loopMaxCycles = cycles;
+}
+
+
+uint32_t loopPercentile(uint32_t total, int percent){            // upper bound in us of the bucket holding the percentile
+  uint32_t count = 0;
+  for (int b=0; b<loopBuckets; b++){
+    count += loopHist[b];
+    if ((uint64_t)count * 100 >= (uint64_t)total * percent){
+      return ((b < loopBuckets - 1) ? (1ULL << b) : loopMaxCycles) / ESP.getCpuFreqMHz();
+    }
+  }
+  return loopMaxCycles / ESP.getCpuFreqMHz();
+}
+
+
+// <myHostname>/stats/loop  loops, p50, p99 and max loop time in us, seconds since the last reset
+// <myHostname>/stats/time  per section: <name> <total ms>/<calls>/<longest call in us>
+// <myHostname>/stats/tasks per task: <name> <runs>/<deadline misses>/<latest start in us>/<longest run in us>
+void publishTiming(){
+  uint32_t mhz = ESP.getCpuFreqMHz();
+  uint32_t total = 0;
+  for (int b=0; b<loopBuckets; b++) total += loopHist[b];
+  snprintf(reply, sizeof(reply), "loops %lu p50 %luus p99 %luus max %luus over %lus",
+           (unsigned long)total, (unsigned long)loopPercentile(total, 50), (unsigned long)loopPercentile(total, 99),
+           (unsigned long)(loopMaxCycles / mhz), (halMillis() - statsSince) / 1000);
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/stats/loop", topicPrefix, myHostname);
+  halPublish(pubTopic, reply);
+
+  sectionStats copy[numSections];
+  noInterrupts();                                                 // the ISR updates the shift section
+  memcpy(copy, sections, sizeof(copy));
+  interrupts();
+  size_t used = 0;
+  for (int i=0; i<numSections; i++){
+    appendReply(used, "%s%s %lu/%lu/%lu", i ? ", " : "", sectionNames[i],
+                (unsigned long)(copy[i].cycles / mhz / 1000), (unsigned long)copy[i].calls,
+                (unsigned long)(copy[i].maxCycles / mhz));
+  }
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/stats/time", topicPrefix, myHostname);
+  halPublish(pubTopic, reply);
+
+  used = 0;
+  for (int t=0; t<numTasks; t++){
+    const taskStats &counts = taskCounts[t];
+    appendReply(used, "%s%s %lu/%lu/%lu/%lu", t ? ", " : "", taskTable[t].name,
+                (unsigned long)counts.runs, (unsigned long)counts.misses, (unsigned long)counts.maxLate,
+                (unsigned long)counts.maxRun);
+  }
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/stats/tasks", topicPrefix, myHostname);
+  halPublish(pubTopic, reply);
+}
+
+
+void resetTiming(){
+  noInterrupts();
+  memset(sections, 0, sizeof(sections));
+  interrupts();
+  memset(loopHist, 0, sizeof(loopHist));
+  memset(taskCounts, 0, sizeof(taskCounts));
+  loopMaxCycles = 0;
+  statsSince = halMillis();
+}
+
+
+// ================================== benchmarks ================================= //
+// The bench server command times the hot paths on the board itself, the refresh interrupts
+// included like in real use. The message benchmarks only fill command slots and dirty bits,
+// those are put back afterwards, so the signals do not change.
+// Every run is kept in RTC memory, which survives a restart and an OTA update but not a power
+// cycle, so the run on the next build shows what changed.
+//   <myHostname>/bench            <name> <ns per call> heap <free heap change per call> [<change against the last run>]
+// The heap figure is the change in free heap, not a count of allocations: a call that allocates
+// and frees again shows 0, the microbench of host/ counts those.
+//   <myHostname>/bench/regressed  the names more than benchRegression percent slower, or none
+enum bench_t : uint8_t {
+  BENCH_SET = 0,                    // <head>/set GREEN
+  BENCH_LIGHT,                      // light/set/<head>-green ON
+  BENCH_FLASHING,                   // light/set/<head>-flashing ON
+  BENCH_QUERY,                      // <head> ?
+  BENCH_OTHER,                      // the head of another server
+  BENCH_UPDATE,                     // updateHeads() on the heads as they are now
+  BENCH_RENDER,                     // renderFrames(), all sub frames
+  BENCH_FORMAT,                     // topic and aspect text of a head
+  BENCH_TIME,                       // utcTime()
+  numBenches
+};
+const char* benchNames[] = {"set", "light", "flashing", "query", "other", "update", "render", "format", "time"};
+const uint16_t benchCalls[] = {500, 500, 500, 500, 500, 100, 100, 500, 4};  // utcTime() also prints to Serial
+#define benchRegression 10          // percent slower than the last run that counts as a regression
+#define benchRtcOffset 96           // RTC user memory block of the last run, the first 32 hold the OTA boot command
+const uint32_t benchMagic = 0xBE4C0000 | numBenches;
+struct benchRun {
+  uint32_t magic;
+  uint32_t ns[numBenches];          // per call
+};
+
+void benchCommand(){
+  static char topics[BENCH_OTHER + 1][maxTopicLength];
+  static const char* payloads[BENCH_OTHER + 1] = {"GREEN", "ON", "ON", "?", "RED"};
+  static uint8_t frames[subFrames][numShiftRegisters];
+  static char regressed[numBenches * 12];
+  int s = 0;
+  while ((s < numSignalHeads) && (Heads.name[s] == NULL)) s++;
+  if (s == numSignalHeads) return;                                // no heads to bench with
+  snprintf(topics[BENCH_SET], maxTopicLength, "%s%s/set", topicPrefix, Heads.name[s]);
+  snprintf(topics[BENCH_LIGHT], maxTopicLength, "%slight/set/%s-green", topicPrefix, Heads.name[s]);
+  snprintf(topics[BENCH_FLASHING], maxTopicLength, "%slight/set/%s-flashing", topicPrefix, Heads.name[s]);
+  snprintf(topics[BENCH_QUERY], maxTopicLength, "%s%s", topicPrefix, Heads.name[s]);
+  snprintf(topics[BENCH_OTHER], maxTopicLength, "%sno-such-head/set", topicPrefix);
+
+  uint32_t saved[5][numHeadWords];                                // what the message benchmarks touch
+  memcpy(saved[0], Heads.pending, sizeof(saved[0]));
+  memcpy(saved[1], Heads.pendingAspect, sizeof(saved[1]));
+  memcpy(saved[2], Heads.pendingFlash, sizeof(saved[2]));
+  memcpy(saved[3], publishDirty, sizeof(saved[3]));
+  memcpy(saved[4], Heads.pendingBatch, sizeof(saved[4]));
+  long savedMsgs = msgCnt;
+  long savedDropped = msgDropped;
+  tracePaused = true;
+
+  benchRun run, last;
+  ESP.rtcUserMemoryRead(benchRtcOffset, (uint32_t*)&last, sizeof(last));
+  boolean compare = (last.magic == benchMagic);
+  uint32_t mhz = ESP.getCpuFreqMHz();
+  size_t used = 0;
+  size_t regressedUsed = 0;
+  for (int b=0; b<numBenches; b++){
+    uint32_t heap = ESP.getFreeHeap();
+    uint32_t start = halCycles();
+    for (int i=0; i<benchCalls[b]; i++){
+      switch (b){
+        case BENCH_UPDATE: updateHeads(); break;
+        case BENCH_RENDER: renderFrames(frames); break;
+        case BENCH_FORMAT:
+          snprintf(pubTopic, sizeof(pubTopic), "%s%s", topicPrefix, Heads.name[s]);
+          snprintf(message, sizeof(message), "%s", trueAspect(s));
+          break;
+        case BENCH_TIME: utcTime(); break;
+        default: handleMessage(topics[b], (byte*)payloads[b], strlen(payloads[b]));
+      }
+    }
+    uint32_t cycles = halCycles() - start;
+    long heapDelta = ((long)ESP.getFreeHeap() - (long)heap) / benchCalls[b];
+    run.ns[b] = (uint64_t)cycles * 1000 / mhz / benchCalls[b];
+    appendReply(used, "%s%s %luns heap %+ldB", used ? ", " : "", benchNames[b], (unsigned long)run.ns[b], heapDelta);
+    if (compare && last.ns[b]){
+      long change = ((long)run.ns[b] - (long)last.ns[b]) * 100 / (long)last.ns[b];
+      appendReply(used, " %+ld%%", change);
+      if (change > benchRegression){
+        regressedUsed += snprintf(regressed + regressedUsed, sizeof(regressed) - regressedUsed, "%s%s",
+                                  regressedUsed ? " " : "", benchNames[b]);
+      }
+    }
+    yield();                                                      // let the WiFi stack run in between
+  }
+
+  memcpy(Heads.pending, saved[0], sizeof(saved[0]));
+  memcpy(Heads.pendingAspect, saved[1], sizeof(saved[1]));
+  memcpy(Heads.pendingFlash, saved[2], sizeof(saved[2]));
+  memcpy(publishDirty, saved[3], sizeof(saved[3]));
+  memcpy(Heads.pendingBatch, saved[4], sizeof(saved[4]));
+  msgCnt = savedMsgs;
+  msgDropped = savedDropped;
+  tracePaused = false;
+  run.magic = benchMagic;
+  ESP.rtcUserMemoryWrite(benchRtcOffset, (uint32_t*)&run, sizeof(run));
+
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/bench", topicPrefix, myHostname);
+  halPublish(pubTopic, reply);
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/bench/regressed", topicPrefix, myHostname);
+  halPublish(pubTopic, compare ? (regressedUsed ? regressed : "none") : "no last run");
+}
+
+
+// ================================ head snapshot ================================ //
+boolean snapshotValid(const headSnapshot &snap){
+  return (snap.magic == snapshotMagic) &&
+         (snap.crc == crc32Update(0, &snap.aspect, sizeof(snap) - offsetof(headSnapshot, aspect)));
+}
+
+
+// Take the snapshot from RTC memory, or from flash after a power cycle. The heads show their
+// aspect at full brightness right away, no fade, false when there was no valid snapshot.
+boolean restoreSnapshot(){
+  static headSnapshot snap;
+  static_assert(snapshotRtcOffset + sizeof(headSnapshot) / 4 <= benchRtcOffset, "the snapshot does not fit in RTC memory");
+  ESP.rtcUserMemoryRead(snapshotRtcOffset, (uint32_t*)&snap, sizeof(snap));
+  if (snapshotValid(snap)) bootSource = "rtc";
+  else {
+    File f = fsMounted ? LittleFS.open(snapshotFile, "r") : File();
+    boolean read = f && (f.read((uint8_t*)&snap, sizeof(snap)) == sizeof(snap));
+    if (f) f.close();
+    if (!read || !snapshotValid(snap)) return false;
+    bootSource = "flash";
+    ESP.rtcUserMemoryWrite(snapshotRtcOffset, (uint32_t*)&snap, sizeof(snap));
+  }
+  for (int s=0; s<numSignalHeads; s++){
+    if (Heads.name[s] == NULL) continue;                          // unused outputs stay dark
+    aspect_t aspect = (aspect_t)((snap.aspect[s / 16] >> ((s % 16) * 2)) & B11);
+    setHead(Heads.aspect, s, aspect);
+    setHead(Heads.currentAspect, s, aspect);
+    setHead(Heads.targetAspect, s, aspect);
+    setHeadFlag(Heads.flash, s, (snap.flash[s / 16] >> (s % 16)) & 1);
+    setHead(Heads.pin, s, (aspect == ASPECT_DARK) ? B11 : (aspect == ASPECT_GREEN) ? B10 : B01);
+    setHeadBits(Heads.dimPattern, 8, s, (aspect == ASPECT_DARK) ? 0 : 255);
+    setHeadFlag(Heads.dimmed, s, aspect == ASPECT_DARK);
+    Heads.fadeStep[s] = fadeSteps - 1;
+  }
+  snapshotDirty = (bootSource[0] == 'r');                         // changes of the last minute may not be in flash,
+                                                                  // saveSnapshot() takes its copy from the heads then
+  return true;
+}
+
+
+// RTC memory on every change, it is fast and does not wear. The flash file at most every
+// snapshotFlashTime, written next to the old one and renamed over it, so a power cut in
+// the middle leaves the previous snapshot.
+void saveSnapshot(){
+  static headSnapshot snap;
+  if (snapshotDirty){
+    memcpy(snap.aspect, Heads.aspect, sizeof(snap.aspect));
+    for (int w=0; w<numHeadWords; w++){
+      uint16_t bits = 0;
+      for (int h=0; h<16; h++) bits |= ((Heads.flash[w] >> (h * 2)) & 1) << h;
+      snap.flash[w] = bits;
+    }
+    snap.magic = snapshotMagic;
+    snap.crc = crc32Update(0, &snap.aspect, sizeof(snap) - offsetof(headSnapshot, aspect));
+    ESP.rtcUserMemoryWrite(snapshotRtcOffset, (uint32_t*)&snap, sizeof(snap));
+    snapshotDirty = false;
+    flashDirty = true;
+  }
+  if (flashDirty && fsMounted && (msSince(lastFlashWrite) >= snapshotFlashTime)){
+    lastFlashWrite = now;
+    flashDirty = false;
+    File f = LittleFS.open(snapshotFile ".new", "w");
+    if (!f) return;
+    boolean written = (f.write((const uint8_t*)&snap, sizeof(snap)) == sizeof(snap));
+    f.close();
+    if (written) LittleFS.rename(snapshotFile ".new", snapshotFile);
+  }
+}
+
+
+// ============================== head configuration ============================= //
+// The header must fit this sketch and the CRC the rest of the file, before anything is loaded.
+boolean configValid(File &f, configHeader &header){
+  if (f.read((uint8_t*)&header, sizeof(header)) != sizeof(header)) return false;
+  if ((header.magic != configMagic) || (header.version != configVersion) || (header.outputs != numSignalHeads)
+      || (header.heads > numSignalHeads) || (header.indexSize != headIndexSize)
+      || (header.arenaSize == 0) || (header.arenaSize > sizeof(configArena)) || (header.prefix >= header.arenaSize)
+      || !configFlashTimeValid(header.flashTime)) return false;
+  size_t body = header.heads * sizeof(configHead) + header.indexSize * sizeof(int16_t) + header.arenaSize;
+  if (f.size() != sizeof(header) + body) return false;
+  uint8_t chunk[64];
+  uint32_t crc = 0;
+  for (size_t done = 0; done < body; ){
+    size_t got = f.read(chunk, min(sizeof(chunk), body - done));
+    if (got == 0) return false;
+    crc = crc32Update(crc, chunk, got);
+    done += got;
+  }
+  return crc == header.crc;
+}
+
+
+// The name index has to end every lookup: each slot empty or one of the heads the image names,
+// and at least one slot empty. Otherwise findHead() reads a NULL name or probes forever.
+boolean configIndexValid(File &f, const configHeader &header){
+  uint32_t named[numHeadWords] = {0};
+  for (int h=0; h<header.heads; h++){
+    configHead head;
+    if (f.read((uint8_t*)&head, sizeof(head)) != sizeof(head)) return false;
+    if ((head.output < numSignalHeads) && (head.name < header.arenaSize)) setHeadFlag(named, head.output, true);
+  }
+  int16_t slots[32];
+  int empty = 0;
+  for (int i=0; i<header.indexSize; i+=32){
+    int count = min(32, header.indexSize - i);
+    if (f.read((uint8_t*)slots, count * sizeof(int16_t)) != count * sizeof(int16_t)) return false;
+    for (int k=0; k<count; k++){
+      if (slots[k] == -1) empty++;
+      else if ((slots[k] < 0) || (slots[k] >= numSignalHeads) || !getHead(named, slots[k])) return false;
+    }
+  }
+  return empty > 0;
+}
+
+
+// Read /config.bin into the head table, headIndex and configArena, false when there is no valid
+// image, the tables are unchanged then. Only the names, bulbs and settings are set, the caller
+// decides what happens to the head state.
+boolean loadConfig(){
+  if (!fsMounted) return false;
+  unsigned long start = halMillis();
+  File f = LittleFS.open(configFile, "r");
+  if (!f) return false;
+  configHeader header;
+  boolean valid = configValid(f, header) && f.seek(sizeof(header)) && configIndexValid(f, header) && f.seek(sizeof(header));
+  if (valid){
+    for (int s=0; s<numSignalHeads; s++){
+      Heads.name[s] = NULL;
+      Heads.bulb[s] = BULB_MINIATURE;
+    }
+    for (int h=0; h<header.heads; h++){
+      configHead head;
+      f.read((uint8_t*)&head, sizeof(head));
+      if ((head.output >= numSignalHeads) || (head.name >= header.arenaSize)) continue;
+      Heads.name[head.output] = configArena + head.name;
+      Heads.bulb[head.output] = (head.bulb < sizeof(bulbTypes) / sizeof(bulbTypes[0])) ? (bulb_t)head.bulb : BULB_MINIATURE;
+    }
+    f.read((uint8_t*)headIndex, sizeof(headIndex));
+    f.read((uint8_t*)configArena, header.arenaSize);
+    configArena[header.arenaSize - 1] = 0;                        // the last name ends in the arena
+    topicPrefix = configArena + header.prefix;
+    flashTime = header.flashTime;
+    yellowCycle = header.yellowCycle;
+    configSource = configFile;
+    configLoadTime = halMillis() - start;
+  }
+  f.close();
+  return valid;
+}
+
+
+// reload server command: outputs that lost their head cool down to dark, new heads warm up to
+// red like at boot, the others keep their state. The old topics are gone with the old names, so
+// the broker connection starts over and subscribes to the new ones.
+//   <myHostname>/config  what was loaded, or why nothing changed, under the prefix the command came with
+void reloadConfig(){
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/config", topicPrefix, myHostname);
+  uint32_t named[numHeadWords] = {0};
+  for (int s=0; s<numSignalHeads; s++) setHeadFlag(named, s, Heads.name[s] != NULL);
+  boolean loaded = loadConfig();
+  int heads = 0;
+  for (int s=0; s<numSignalHeads; s++){
+    if (Heads.name[s] != NULL) heads++;
+    if (!loaded || ((Heads.name[s] != NULL) == (getHead(named, s) != 0))) continue;
+    setHead(Heads.aspect, s, (Heads.name[s] == NULL) ? ASPECT_DARK : ASPECT_RED);
+    setHead(Heads.targetAspect, s, ASPECT_DARK);                  // the colour shown fades out first
+    setHeadFlag(Heads.flash, s, false);
+    setHeadFlag(Heads.pending, s, false);
+    setHeadFlag(publishDirty, s, false);
+    headsIdle = false;
+    snapshotDirty = true;
+  }
+  framesDirty = true;                                              // a new yellow mix shows right away
+  if (loaded) snprintf(message, sizeof(message), "%s: %d heads in %lu ms", configFile, heads, configLoadTime);
+  else snprintf(message, sizeof(message), "no valid %s, kept %d heads from %s", configFile, heads, configSource);
+  halPublish(pubTopic, message);
+  if (!loaded) return;
+  client.disconnect();
+  netState = NET_MQTT_DOWN;
+  nextAttempt = now;
+}
+
+
+// ================================= OTA updates ================================= //
+void onOTAStart(){
+  Serial.println("Start OTA loading...");
+  ota.bytes = 0;
+  ota.maxStall = 0;
+  ota.error = otaNoError;
+  otaStart = otaLastChunk = otaLastPrint = halMillis();
+}
+
+
+void onOTAProgress(unsigned int progress, unsigned int total){   // after every chunk the Updater took
+  unsigned long t = halMillis();
+  if (t - otaLastChunk > ota.maxStall) ota.maxStall = t - otaLastChunk;
+  otaLastChunk = t;
+  ota.bytes = progress;
+  runTask(TASK_HEADS);                                             // fades and flashing go on
+  if (t - otaLastPrint >= otaPrintTime){
+    otaLastPrint = t;
+    Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
+  }
+}
+
+
+void onOTAEnd(){                                                   // the restart follows right away
+  Serial.println("\nEnd OTA loading.");
+  saveOta();
+}
+
+
+void onOTAError(ota_error_t error){
+  Serial.printf("Error[%u]: ", error);
+  if (error == OTA_AUTH_ERROR) Serial.println("Auth Failed");
+  else if (error == OTA_BEGIN_ERROR) Serial.println("Begin Failed");
+  else if (error == OTA_CONNECT_ERROR) Serial.println("Connect Failed");
+  else if (error == OTA_RECEIVE_ERROR) Serial.println("Receive Failed");
+  else if (error == OTA_END_ERROR) Serial.println("End Failed");
+  ota.error = error;
+  saveOta();
+  publishOta();                                                    // no restart, tell right away
+}
+
+
+void saveOta(){
+  static_assert(benchRtcOffset + sizeof(benchRun) / 4 <= otaRtcOffset, "the bench run and the OTA report overlap");
+  static_assert(otaRtcOffset + sizeof(otaReport) / 4 <= 128, "the OTA report does not fit in the 128 words of RTC user memory");
+  ota.ms = halMillis() - otaStart;
+  ota.magic = otaMagic;
+  ESP.rtcUserMemoryWrite(otaRtcOffset, (uint32_t*)&ota, sizeof(ota));
+}
+
+
+// <myHostname>/stats/ota  bytes received, time, throughput, the longest wait of the heads
+//                         and the error, once after the update
+void publishOta(){
+  otaReport last;
+  ESP.rtcUserMemoryRead(otaRtcOffset, (uint32_t*)&last, sizeof(last));
+  if (last.magic != otaMagic) return;
+  snprintf(message, sizeof(message), "%lu bytes in %lu ms, %lu B/s, heads stalled %lu ms, %s",
+           (unsigned long)last.bytes, (unsigned long)last.ms,
+           (unsigned long)(last.ms ? (uint64_t)last.bytes * 1000 / last.ms : 0), (unsigned long)last.maxStall,
+           (last.error == otaNoError) ? "ok" : "failed");
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/stats/ota", topicPrefix, myHostname);
+  if (!halPublish(pubTopic, message)) return;                      // try again after the next update or error
+  last.magic = 0;
+  ESP.rtcUserMemoryWrite(otaRtcOffset, (uint32_t*)&last, sizeof(last));
+}
+
+
+// <myHostname>/stats/boot  reset reason, where the head state came from and when it showed,
+//                          where the configuration came from and how long it and the mount took
+void publishBoot(){
+  snprintf(message, sizeof(message), "reset %s, heads from %s, shown after %lu ms, config %s in %lu ms, mount %lu ms",
+           ESP.getResetReason().c_str(), bootSource, bootShown, configSource, configLoadTime, fsMountTime);
+  snprintf(pubTopic, sizeof(pubTopic), "%s%s/stats/boot", topicPrefix, myHostname);
+  halPublish(pubTopic, message);
+}
+
+
+const char* flashingNames[] = {"FLASHINGDARK", "FLASHINGGREEN", "FLASHINGRED", "FLASHINGYELLOW"};
+
+const char* trueAspect(int s){                  // the aspect as JMRI sends it, a waiting command included
+  if (getHead(Heads.pending, s)){
+    uint8_t aspect = getHead(Heads.pendingAspect, s);
+    return getHead(Heads.pendingFlash, s) ? flashingNames[aspect] : aspectNames[aspect];
+  }
+  uint8_t aspect = getHead(Heads.aspect, s);
+  return getHead(Heads.flash, s) ? flashingNames[aspect] : aspectNames[aspect];
+}
+
+
+
+void serverCommands(const byte* payload, unsigned int length){ // do we have server commands to process?
+#if defined(CAPTURE)
+  if ((length > 8) && (strncmp((const char*)payload, "capture ", 8) == 0)){  // capture start | stop | dump
+    captureCommand((const char*)payload + 8, length - 8);
+    return;
+  }
+#endif
+  if ((length >= 5) && (strncmp((const char*)payload, "trace", 5) == 0)){   // trace [head <head>|all|none | serial on|off]
+    traceCommand((const char*)payload + 5, length - 5);
+    return;
+  }
+  if ((length == 5) && (strncmp((const char*)payload, "bench", 5) == 0)){
+    benchCommand();
+    return;
+  }
+  if ((length == 6) && (strncmp((const char*)payload, "reload", 6) == 0)){  // configuration from /config.bin
+    reloadConfig();
+    return;
+  }
+  if ((length >= 5) && (strncmp((const char*)payload, "stats", 5) == 0)){   // stats, or stats reset
+    boolean reset = (length == 11) && (strncmp((const char*)payload + 5, " reset", 6) == 0);  // payload is in the client buffer, the publishes overwrite it
+    publishTiming();
+    publishMemory();
+    if (reset) resetTiming();
+    return;
+  }
+  if ((length == 5) && (strncmp((const char*)payload, "heads", 5) == 0)){  // for all heads publush their name
+    size_t used = 0;
     for (int s=0; s<numSignalHeads; s++){
-      message += (String) s;
-      message += ":";
-      message += SignalHead[s].name;
-      message += ",";
+      if (Heads.name[s] != NULL) appendReply(used, "%d:%s,", s, Heads.name[s]);
     }
-    message += " total heads:";
-    message += (String) numSignalHeads;
-    client.publish(topicStr.c_str(), message.c_str());
+    appendReply(used, " total heads:%d", numSignalHeads);
+    snprintf(pubTopic, sizeof(pubTopic), "%s%s/heads", topicPrefix, myHostname);
+    halPublish(pubTopic, reply);
   }
 }
@@ -0,0 +1,43 @@
+/*
+  Record format of the trace log, shared by the sketch and the decoder in tools/tracedecode.cpp.
+
+  The sketch keeps the last traceSize records in RAM. It sends them over Serial and publishes
+  them on <myHostname>/trace. Both streams carry the same frames: a traceSync byte, then
+  one traceRecord. The decoder resyncs on the sync byte, so boot text on Serial between the
+  frames does no harm.
+*/
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+const uint8_t traceSync = 0xA5;     // first byte of every frame
+const uint16_t traceNoHead = 0xFFFF;  // head of the events that are not about a head
+
+enum trace_t : uint8_t {
+  TRACE_COMMAND = 0,                // aspect or flashing set by a message
+  TRACE_QUERY,                      // head state asked for
+  TRACE_UNKNOWN,                    // payload for a head not understood, arg is its payload_t
+  TRACE_DROPPED,                    // message that is not for us
+  TRACE_LIT,                        // head starts to warm up its new colour
+  TRACE_STEP,                       // fade step, only for the heads picked with trace head
+  TRACE_DARK,                       // head cooled down to dark
+  TRACE_NET,                        // connection state changed, arg is the new net_t
+  TRACE_LOST,                       // records overwritten before they were sent, arg is the count, at most 255
+  numTraceEvents
+};
+
+// The head state is packed in a byte: bits 0-1 aspect, bits 2-3 target aspect,
+// bits 4-5 the colour shown (aspect_t values), bit 6 flashing.
+struct __attribute__((packed)) traceRecord {  // 12 bytes, little endian like the ESP8266
+  uint32_t time;                    // ms since boot
+  uint16_t head;                    // head number or traceNoHead
+  uint8_t event;                    // trace_t
+  uint8_t from;                     // head state before the event
+  uint8_t to;                       // head state after the event
+  uint8_t level;                    // brightness 0-255 after the event
+  uint8_t pins;                     // the pin field of the head, B10 drives green, B01 red
+  uint8_t arg;                      // depends on the event
+};
+
+#endif
@@ -0,0 +1,253 @@
+/*
+  Compiler for the head configuration image of the signal server.
+
+  Reads a text layout and writes the image in the format of src/config.h, to go into the LittleFS
+  of the server as /config.bin. It checks the layout against what the sketch can hold, builds the
+  name index the way the sketch would, then reads the image back like the sketch does and prints
+  its size and how long that took.
+
+  Layout, one setting per line, # starts a comment:
+    registers 2                 numShiftRegisters of the sketch, it refuses an image for another count
+    prefix JMRI/signal/         topic prefix
+    flash 1000                  ms per flash phase, a day holds an even number of them
+    yellow 0xC0                 sub frames that show green for yellow
+    head 0 AMW-A                output (head number) and name: register 0, pins 0 and 1
+    head 5 AMW-F led            bulb: miniature (the default), wheat or led
+
+  Build:  g++ -O2 -o configbuild tools/configbuild.cpp
+  Use:    configbuild layout.txt config.bin
+          mosquitto_pub -t JMRI/signal/HOsrv01 -m reload                   (once config.bin is in LittleFS)
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "../src/config.h"
+
+const char* bulbNames[] = {"miniature", "wheat", "led"};        // bulb_t of the sketch
+const int numBulbs = 3;
+const size_t maxTopicLength = 128;                              // of the sketch, for light/set/<head>-flashing
+
+struct layoutHead {
+  int output;
+  std::string name;
+  int bulb;
+};
+
+struct layout {
+  int registers = 0;
+  std::string prefix = "JMRI/signal/";
+  long flashTime = 1000;
+  long yellowCycle = 0xC0;
+  std::vector<layoutHead> heads;
+};
+
+int errors = 0;
+
+void error(const char* file, int line, const char* text, const char* arg = ""){
+  fprintf(stderr, "%s:%d: %s%s\n", file, line, text, arg);
+  errors++;
+}
+
+bool validName(const std::string &name){                    // usable as a topic level
+  return !name.empty() && (name.find_first_of("/+#") == std::string::npos);
+}
+
+bool readLayout(const char* file, layout &l){
+  FILE* in = fopen(file, "r");
+  if (in == NULL){
+    perror(file);
+    return false;
+  }
+  char text[256];
+  int line = 0;
+  while (fgets(text, sizeof(text), in)){
+    line++;
+    char* hash = strchr(text, '#');
+    if (hash) *hash = 0;
+    char word[256], name[256], bulb[256];
+    long value;
+    int got;
+    if (sscanf(text, "%255s", word) != 1) continue;           // empty or comment
+    if (strcmp(word, "registers") == 0){
+      if ((sscanf(text, "%*s %ld", &value) != 1) || (value < 1) || (value > 1024)) error(file, line, "registers 1 to 1024");
+      else l.registers = value;
+    } else if (strcmp(word, "prefix") == 0){
+      if (sscanf(text, "%*s %255s", name) != 1) error(file, line, "prefix needs a topic");
+      else l.prefix = name;
+    } else if (strcmp(word, "flash") == 0){
+      if ((sscanf(text, "%*s %li", &value) != 1) || (value < 1) || (value > 65535) || !configFlashTimeValid(value))
+        error(file, line, "flash time in ms must divide a day an even number of times and be at most 65535");
+      else l.flashTime = value;
+    } else if (strcmp(word, "yellow") == 0){
+      if ((sscanf(text, "%*s %li", &value) != 1) || (value < 0) || (value > 255)) error(file, line, "yellow 0 to 255");
+      else l.yellowCycle = value;
+    } else if (strcmp(word, "head") == 0){
+      got = sscanf(text, "%*s %ld %255s %255s", &value, name, bulb);
+      if (got < 2){
+        error(file, line, "head <output> <name> [bulb]");
+        continue;
+      }
+      layoutHead h = {(int)value, name, 0};
+      if (!validName(h.name)) error(file, line, "name cannot hold / + or #: ", name);
+      if (got == 3){
+        h.bulb = -1;
+        for (int b=0; b<numBulbs; b++) if (strcmp(bulb, bulbNames[b]) == 0) h.bulb = b;
+        if (h.bulb < 0) error(file, line, "unknown bulb: ", bulb);
+      }
+      l.heads.push_back(h);
+    } else error(file, line, "unknown setting: ", word);
+  }
+  fclose(in);
+  return true;
+}
+
+void checkLayout(const char* file, const layout &l){
+  if (l.registers == 0){
+    error(file, 0, "registers missing");
+    return;
+  }
+  int outputs = l.registers * 4;
+  std::vector<bool> used(outputs);
+  size_t arenaSize = l.prefix.size() + 1;
+  for (size_t i=0; i<l.heads.size(); i++){
+    const layoutHead &h = l.heads[i];
+    if ((h.output < 0) || (h.output >= outputs)){
+      error(file, 0, "output out of range for head ", h.name.c_str());
+      continue;
+    }
+    if (used[h.output]) error(file, 0, "output used twice by head ", h.name.c_str());
+    used[h.output] = true;
+    for (size_t j=0; j<i; j++) if (l.heads[j].name == h.name) error(file, 0, "name used twice: ", h.name.c_str());
+    if (l.prefix.size() + strlen("light/set/") + h.name.size() + strlen("-flashing") >= maxTopicLength)
+      error(file, 0, "topics too long for head ", h.name.c_str());
+    arenaSize += h.name.size() + 1;
+  }
+  if (arenaSize > (size_t)configArenaSizeFor(outputs)){
+    fprintf(stderr, "%s: names and prefix take %zu bytes, the sketch has room for %d, use shorter names\n",
+            file, arenaSize, configArenaSizeFor(outputs));
+    errors++;
+  }
+}
+
+// the image in the order of config.h, the heads and the index in the order the sketch would build them
+std::vector<uint8_t> buildImage(const layout &l, int &longestProbe){
+  int outputs = l.registers * 4;
+  std::vector<layoutHead> byOutput(outputs, layoutHead{-1, "", 0});
+  for (const layoutHead &h : l.heads) byOutput[h.output] = h;
+
+  std::string arena;
+  std::vector<configHead> records;
+  std::vector<int16_t> index(headIndexSizeFor(outputs), -1);
+  longestProbe = 0;
+  for (const layoutHead &h : byOutput){
+    if (h.output < 0) continue;
+    configHead r = {(uint16_t)h.output, (uint16_t)arena.size(), (uint8_t)h.bulb, 0};
+    records.push_back(r);
+    arena += h.name;
+    arena += '\0';
+    uint32_t slot = nameHash(h.name.c_str(), h.name.size()) & (index.size() - 1);
+    int probe = 1;
+    while (index[slot] >= 0){
+      slot = (slot + 1) & (index.size() - 1);
+      probe++;
+    }
+    index[slot] = h.output;
+    if (probe > longestProbe) longestProbe = probe;
+  }
+  configHeader header = {};
+  header.magic = configMagic;
+  header.version = configVersion;
+  header.outputs = outputs;
+  header.heads = records.size();
+  header.indexSize = index.size();
+  header.prefix = arena.size();
+  arena += l.prefix;
+  arena += '\0';
+  header.arenaSize = arena.size();
+  header.flashTime = l.flashTime;
+  header.yellowCycle = l.yellowCycle;
+
+  std::vector<uint8_t> body;
+  body.insert(body.end(), (uint8_t*)records.data(), (uint8_t*)(records.data() + records.size()));
+  body.insert(body.end(), (uint8_t*)index.data(), (uint8_t*)(index.data() + index.size()));
+  body.insert(body.end(), arena.begin(), arena.end());
+  header.crc = crc32Update(0, body.data(), body.size());
+  std::vector<uint8_t> image(sizeof(header) + body.size());
+  memcpy(image.data(), &header, sizeof(header));
+  memcpy(image.data() + sizeof(header), body.data(), body.size());
+  return image;
+}
+
+// what loadConfig() in the sketch does with the image, false when it would refuse it
+bool loadImage(const std::vector<uint8_t> &image, int outputs, const char** names, int16_t* index, char* arena){
+  configHeader header;
+  if (image.size() < sizeof(header)) return false;
+  memcpy(&header, image.data(), sizeof(header));
+  size_t body = header.heads * sizeof(configHead) + header.indexSize * sizeof(int16_t) + header.arenaSize;
+  if ((header.magic != configMagic) || (header.version != configVersion) || (header.outputs != outputs)
+      || (header.indexSize != headIndexSizeFor(outputs)) || (header.arenaSize > configArenaSizeFor(outputs))
+      || (image.size() != sizeof(header) + body)
+      || (crc32Update(0, image.data() + sizeof(header), body) != header.crc)) return false;
+  const uint8_t* p = image.data() + sizeof(header);
+  for (int s=0; s<outputs; s++) names[s] = NULL;
+  for (int h=0; h<header.heads; h++){
+    configHead r;
+    memcpy(&r, p, sizeof(r));
+    p += sizeof(r);
+    if ((r.output >= outputs) || (r.name >= header.arenaSize)) continue;
+    names[r.output] = arena + r.name;
+  }
+  memcpy(index, p, header.indexSize * sizeof(int16_t));
+  p += header.indexSize * sizeof(int16_t);
+  int empty = 0;                                  // like configIndexValid() of the sketch
+  for (int i=0; i<header.indexSize; i++){
+    if (index[i] == -1) empty++;
+    else if ((index[i] < 0) || (index[i] >= outputs) || (names[index[i]] == NULL)) return false;
+  }
+  if (empty == 0) return false;
+  memcpy(arena, p, header.arenaSize);
+  return true;
+}
+
+int main(int argc, char** argv){
+  if (argc != 3){
+    fprintf(stderr, "use: %s <layout.txt> <config.bin>\n", argv[0]);
+    return 2;
+  }
+  layout l;
+  if (!readLayout(argv[1], l)) return 1;
+  checkLayout(argv[1], l);
+  if (errors) return 1;
+
+  int outputs = l.registers * 4;
+  int longestProbe;
+  std::vector<uint8_t> image = buildImage(l, longestProbe);
+  const configHeader* header = (const configHeader*)image.data();
+
+  FILE* out = fopen(argv[2], "wb");
+  if ((out == NULL) || (fwrite(image.data(), 1, image.size(), out) != image.size()) || fclose(out)){
+    perror(argv[2]);
+    return 1;
+  }
+
+  std::vector<const char*> names(outputs);
+  std::vector<int16_t> index(headIndexSizeFor(outputs));
+  std::vector<char> arena(configArenaSizeFor(outputs));
+  const int rounds = 1000;
+  auto start = std::chrono::steady_clock::now();
+  bool loaded = true;
+  for (int r=0; r<rounds; r++) loaded = loaded && loadImage(image, outputs, names.data(), index.data(), arena.data());
+  double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / rounds;
+  if (!loaded){
+    fprintf(stderr, "the image does not load back\n");
+    return 1;
+  }
+  printf("%s: %zu heads on %d outputs, %zu bytes\n", argv[2], l.heads.size(), outputs, image.size());
+  printf("  names and prefix %u of %d bytes, index %u slots, longest probe %d\n",
+         header->arenaSize, configArenaSizeFor(outputs), header->indexSize, longestProbe);
+  printf("  checked and loaded in %.1f us on this host, the server tells its own time on reload\n", us);
+  return 0;
+}
@@ -0,0 +1,87 @@
+/*
+  Decoder for the trace log of the signal server.
+
+  Reads frames in the format of src/trace.h from a file or stdin and prints one line per record.
+  It takes what the server sends over Serial (boot text in between is skipped) as well as
+  the payloads of <myHostname>/trace appended to each other.
+
+  Build:  g++ -O2 -o tracedecode tools/tracedecode.cpp
+  Use:    mosquitto_sub -t JMRI/signal/HOsrv01/trace -C 19 > trace.bin     (then send the trace command)
+          tracedecode trace.bin
+          tracedecode < /dev/ttyUSB0                                        (a debug build, 9600 baud)
+*/
+#include <stdio.h>
+#include <string.h>
+#include "../src/trace.h"
+
+const char* eventNames[] = {"COMMAND", "QUERY", "UNKNOWN", "DROPPED", "LIT", "STEP", "DARK", "NET", "LOST"};
+const char* aspectNames[] = {"DARK", "GREEN", "RED", "YELLOW"};
+const char* netNames[] = {"wifi down", "mqtt down", "up"};
+const char* payloadNames[] = {"other", "aspect", "ON", "OFF", "?"};
+
+void printState(uint8_t state){                 // aspect, what it shows and where it is going
+  printf("%s%s shows %s>%s", (state & 0x40) ? "FLASHING" : "", aspectNames[state & 3],
+         aspectNames[(state >> 4) & 3], aspectNames[(state >> 2) & 3]);
+}
+
+void printRecord(const traceRecord &r){
+  printf("%10.3f %-7s ", r.time / 1000.0, eventNames[r.event]);
+  switch (r.event){
+    case TRACE_DROPPED:
+      break;
+    case TRACE_NET:
+      printf("%s -> %s", r.from < 3 ? netNames[r.from] : "?", r.arg < 3 ? netNames[r.arg] : "?");
+      break;
+    case TRACE_LOST:
+      printf("%u records", r.arg);
+      break;
+    default:
+      printf("head %3u  ", r.head);
+      printState(r.from);
+      printf(" -> ");
+      printState(r.to);
+      printf("  level %3u pins %s", r.level, r.pins == 2 ? "green" : r.pins == 1 ? "red" : "off");
+      if (r.event == TRACE_UNKNOWN) printf("  payload %s", r.arg < 5 ? payloadNames[r.arg] : "?");
+      if ((r.event == TRACE_STEP) || (r.event == TRACE_DARK)) printf("  step %u", r.arg);
+  }
+  printf("\n");
+}
+
+int main(int argc, char** argv){
+  FILE* in = stdin;
+  if (argc > 1){
+    in = fopen(argv[1], "rb");
+    if (in == NULL){
+      perror(argv[1]);
+      return 1;
+    }
+  }
+  setvbuf(stdout, NULL, _IOLBF, 0);             // line by line when following Serial
+  uint8_t frame[1 + sizeof(traceRecord)];
+  size_t have = 0;
+  long records = 0, skipped = 0;
+  int c;
+  while ((c = fgetc(in)) != EOF){
+    frame[have++] = c;
+    if (frame[0] != traceSync){                 // text between the frames
+      have = 0;
+      skipped++;
+      continue;
+    }
+    if (have < sizeof(frame)) continue;
+    traceRecord r;
+    memcpy(&r, frame + 1, sizeof(r));
+    if ((r.event < numTraceEvents) && (r.pins <= 3) && !(r.from & 0x80) && !(r.to & 0x80)){
+      printRecord(r);
+      records++;
+      have = 0;
+    } else {                                    // not a frame after all, resync after this sync byte
+      uint8_t* next = (uint8_t*)memchr(frame + 1, traceSync, sizeof(frame) - 1);
+      have = next ? frame + sizeof(frame) - next : 0;
+      skipped += sizeof(frame) - have;
+      if (next) memmove(frame, next, have);
+    }
+  }
+  fprintf(stderr, "%ld records, %ld bytes skipped\n", records, skipped);
+  return 0;
+}